@@ -1,15 +1,270 @@
+
+#include <map>
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "config.h"
 
 
 namespace Config {
 
 using namespace std;
 
-string server_or_file = "", user = "nobody", chroot = "/var/lib/empty";
+string server_or_file = "", user = "nobody", chroot = "/var/lib/empty", estimator = "intersect",
+       serve_port = "", drift = "/httpdated.drift", metrics = "",
+       log_level = "info", log_file = "";
+
+bool no_set = 0, foreground = 0, slew = 0;
+
+int delay = 1000, sleep = 60*60*6, min_sleep = 1024, boundary = 0, burst = 1, step_threshold = 128,
+    keep_alive = 0, shm_unit = -1;
+
+
+namespace {
+
+// errors reported per call, the rest is only counted
+enum { MAX_ERRORS = 10 };
+
+struct token {
+	const char *p;
+	size_t n;
+
+	bool is(const char *s) const
+	{
+		return strlen(s) == n && memcmp(p, s, n) == 0;
+	}
+
+	string str() const
+	{
+		return string(p, n);
+	}
+};
+
+
+bool number(const token &t, int lo, int hi, int &v)
+{
+	int64_t x = 0;
+	if (t.n == 0 || t.n > 9)
+		return 0;
+	for (size_t i = 0; i < t.n; ++i) {
+		if (t.p[i] < '0' || t.p[i] > '9')
+			return 0;
+		x = x*10 + t.p[i] - '0';
+	}
+	if (x < lo || x > hi)
+		return 0;
+	v = (int)x;
+	return 1;
+}
+
+
+string key(const server_config &c)
+{
+	return c.name + '\0' + c.port + (c.https ? 's' : '\0');
+}
+
+
+// One line: [http://|https://]host[~port] [option [value]]...
+// Returns an error message, empty if fine.
+string parse_line(const vector<token> &tv, server_config &c)
+{
+	token t = tv[0];
+	bool proto = 0;
+	int v = 0;
+	char num[16];
+
+	c.https = 0;
+	c.opt = server_options();
+	if (t.n >= 8 && memcmp(t.p, "https://", 8) == 0) {
+		t.p += 8;
+		t.n -= 8;
+		c.https = proto = 1;
+	} else if (t.n >= 7 && memcmp(t.p, "http://", 7) == 0) {
+		t.p += 7;
+		t.n -= 7;
+		proto = 1;
+	}
 
-bool no_set = 0, foreground = 0;
+	const char *tilde = (const char *)memchr(t.p, '~', t.n);
+	size_t hn = tilde ? tilde - t.p : t.n;
+	if (hn == 0)
+		return "no host";
+	if (hn > 253)
+		return "host name too long";
+	c.name.assign(t.p, hn);
+	c.port = "";
+	if (tilde && tilde + 1 < t.p + t.n) {
+		token pt = {tilde + 1, t.n - hn - 1};
+		if (!number(pt, 1, 65535, v))
+			return "bad port '" + pt.str() + "'";
+		c.port = pt.str();
+	}
 
-int delay = 1, sleep = 60*60*6;
+	for (size_t i = 1; i < tv.size(); ++i) {
+		const token &o = tv[i];
+
+		// flags
+		if (o.is("trusted")) {
+			c.opt.trusted = 1;
+			continue;
+		} else if (o.is("noselect")) {
+			c.opt.noselect = 1;
+			continue;
+		}
+
+		if (!o.is("weight") && !o.is("minpoll") && !o.is("maxpoll") && !o.is("burst") &&
+		    !o.is("proto") && !o.is("family"))
+			return "unknown option '" + o.str() + "'";
+		if (i + 1 >= tv.size())
+			return "option '" + o.str() + "' needs a value";
+		const token &a = tv[++i];
+		if (o.is("weight")) {
+			if (!number(a, 1, 100, c.opt.weight))
+				return "weight must be 1..100";
+		} else if (o.is("minpoll")) {
+			if (!number(a, 1, 7*24*3600, c.opt.minpoll))
+				return "minpoll must be 1..604800 seconds";
+		} else if (o.is("maxpoll")) {
+			if (!number(a, 1, 7*24*3600, c.opt.maxpoll))
+				return "maxpoll must be 1..604800 seconds";
+		} else if (o.is("burst")) {
+			// more would flush the clock filter in one round
+			if (!number(a, 1, clock_filter::STAGES, c.opt.burst)) {
+				snprintf(num, sizeof(num), "%d", (int)clock_filter::STAGES);
+				return string("burst must be 1..") + num;
+			}
+		} else if (o.is("proto")) {
+			bool https = a.is("https");
+			if (!https && !a.is("http"))
+				return "proto must be http or https";
+			if (proto && https != c.https)
+				return "proto contradicts the scheme";
+			c.https = https;
+		} else if (o.is("family")) {
+			if (a.is("inet"))
+				c.opt.family = AF_INET;
+			else if (a.is("inet6"))
+				c.opt.family = AF_INET6;
+			else if (a.is("any"))
+				c.opt.family = AF_UNSPEC;
+			else
+				return "family must be inet, inet6 or any";
+		}
+	}
+	if (c.opt.minpoll > 0 && c.opt.maxpoll > 0 && c.opt.minpoll > c.opt.maxpoll)
+		return "minpoll above maxpoll";
+	if (c.opt.trusted && c.opt.noselect)
+		return "trusted and noselect";
+
+	if (c.port.empty())
+		c.port = c.https ? "443" : "80";
+	return "";
+}
+
+}
+
+
+// Tokenize buf in one pass and append its servers to vc. Blanks separate
+// tokens, # comments out the rest of a line. A server listed again
+// replaces the earlier entry. All malformed lines are reported in e as
+// "what:line: why", one per line; -1 is returned then.
+int parse_servers(const char *buf, size_t len, const string &what, vector<server_config> &vc, string &e)
+{
+	map<string, size_t> seen;
+	for (size_t i = 0; i < vc.size(); ++i)
+		seen[key(vc[i])] = i;
+
+	vector<token> tv;
+	server_config c;
+	int line = 0, errors = 0;
+	char num[32];
+	e = "";
+
+	const char *p = buf, *end = buf + len;
+	while (p < end) {
+		++line;
+		tv.clear();
+
+		// tokens up to the end of the line
+		while (p < end && *p != '\n') {
+			if (*p == ' ' || *p == '\t' || *p == '\r') {
+				++p;
+				continue;
+			}
+			if (*p == '#') {
+				while (p < end && *p != '\n')
+					++p;
+				break;
+			}
+			token t = {p, 0};
+			while (p < end && *p != '\n' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '#')
+				++p;
+			t.n = p - t.p;
+			tv.push_back(t);
+		}
+		++p;
+
+		if (tv.empty())
+			continue;
+
+		string why = parse_line(tv, c);
+		if (why.empty()) {
+			map<string, size_t>::iterator s = seen.find(key(c));
+			if (s == seen.end()) {
+				seen[key(c)] = vc.size();
+				vc.push_back(c);
+			} else
+				vc[s->second] = c;
+			continue;
+		}
+		if (errors++ >= MAX_ERRORS)
+			continue;
+		snprintf(num, sizeof(num), ":%d: ", line);
+		e += what + num + why + "\n";
+	}
+
+	if (errors > MAX_ERRORS) {
+		snprintf(num, sizeof(num), "%d", errors - MAX_ERRORS);
+		e += what + ": " + num + " more errors\n";
+	}
+	if (errors > 0) {
+		e.erase(e.size() - 1);
+		return -1;
+	}
+	return 0;
+}
+
+
+// Parse the whole file behind fd, mapped rather than copied. The fd may
+// be kept and loaded again, e.g. from inside the chroot.
+int load_servers(int fd, const string &what, vector<server_config> &vc, string &e)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		e = what + ": fstat: " + strerror(errno);
+		return -1;
+	}
+	if (st.st_size == 0)
+		return 0;
+
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED) {
+		e = what + ": mmap: " + strerror(errno);
+		return -1;
+	}
+	int r = parse_servers((const char *)m, st.st_size, what, vc, e);
+	munmap(m, st.st_size);
+	return r;
+}
 
 }
 
@@ -2,17 +2,24 @@
 #define __config_h__
 
 #include <string>
+#include <vector>
+
+#include "servers.h"
 
 namespace Config {
 
-extern std::string server_or_file, user, chroot;
+extern std::string server_or_file, user, chroot, estimator, serve_port,
+                   drift, metrics, log_level, log_file;
+
+extern bool no_set, foreground, slew;
 
-extern bool no_set, foreground;
+extern int delay, sleep, min_sleep, boundary, burst, step_threshold, keep_alive, shm_unit;
 
-extern int delay, sleep;
+int parse_servers(const char *, size_t, const std::string &, std::vector<server_config> &, std::string &);
+
+int load_servers(int, const std::string &, std::vector<server_config> &, std::string &);
 
 }
 
 #endif
 
-
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/timex.h>
+#endif
+
+#include "misc.h"
+#include "discipline.h"
+
+
+using namespace std;
+
+
+clock_discipline::clock_discipline()
+	: slew(0), step_threshold(128000), time_constant(6), fll(0), freq(0), freq_known(0),
+	  last_adjust(0), residual(0), last_error(0), drift_fd(-1), e("")
+{
+}
+
+
+clock_discipline::~clock_discipline()
+{
+	if (drift_fd >= 0)
+		close(drift_fd);
+}
+
+
+// The kernel refuses to slew more than 500ms at once
+void clock_discipline::threshold(int64_t usec)
+{
+	if (usec > 500000)
+		usec = 500000;
+	if (usec < 0)
+		usec = 0;
+	step_threshold = usec;
+}
+
+
+// Adapt the loop to the poll interval in seconds, as ntpd does with
+// its poll exponent. Long intervals are better handled by the FLL.
+void clock_discipline::interval(int seconds)
+{
+	int l = 0;
+	while (seconds > 1 && l < 31) {
+		seconds >>= 1;
+		++l;
+	}
+
+	time_constant = l - 4;
+	if (time_constant < 0)
+		time_constant = 0;
+	if (time_constant > 10)
+		time_constant = 10;
+
+	fll = l >= 11;
+}
+
+
+int clock_discipline::step(int64_t offset)
+{
+	int64_t t = real_usec() + offset;
+
+	struct timeval tv;
+	tv.tv_sec = t/1000000;
+	tv.tv_usec = t%1000000;
+	if (settimeofday(&tv, NULL) < 0) {
+		e = "clock_discipline::step::settimeofday:";
+		e += strerror(errno);
+		return -1;
+	}
+	return CLOCK_STEPPED;
+}
+
+
+// The kernel never goes beyond 500ppm
+int clock_discipline::set_frequency(double ppm)
+{
+	if (ppm > 500)
+		ppm = 500;
+	if (ppm < -500)
+		ppm = -500;
+
+#ifdef __linux__
+	struct timex tx;
+	memset(&tx, 0, sizeof(tx));
+	tx.modes = ADJ_FREQUENCY;
+	tx.freq = (long)(ppm*65536.0);
+	if (adjtimex(&tx) < 0) {
+		e = "clock_discipline::set_frequency::adjtimex:";
+		e += strerror(errno);
+		return -1;
+	}
+#endif
+
+	freq = ppm;
+	freq_known = 1;
+	return 0;
+}
+
+
+// Open or create the drift file and start from the frequency saved in
+// it. The fd stays open, so it can be updated from within the chroot.
+int clock_discipline::drift(const string &path)
+{
+	char buf[64];
+	ssize_t r = 0;
+	double ppm = 0;
+
+	if ((drift_fd = open(path.c_str(), O_RDWR|O_CREAT, 0644)) < 0) {
+		e = "clock_discipline::drift::open:";
+		e += strerror(errno);
+		return -1;
+	}
+	fcntl(drift_fd, F_SETFD, FD_CLOEXEC);
+
+	memset(buf, 0, sizeof(buf));
+	if ((r = pread(drift_fd, buf, sizeof(buf) - 1, 0)) <= 0)
+		return 0;
+	if (sscanf(buf, "%lf", &ppm) != 1 || std::isnan(ppm) || fabs(ppm) > 500)
+		return 0;
+	return set_frequency(ppm);
+}
+
+
+int clock_discipline::save()
+{
+	char buf[64];
+
+	if (drift_fd < 0 || !freq_known)
+		return 0;
+
+	int n = snprintf(buf, sizeof(buf), "%.3f\n", freq);
+	if (pwrite(drift_fd, buf, n, 0) != n || ftruncate(drift_fd, n) < 0) {
+		e = "clock_discipline::save::pwrite:";
+		e += strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+// Whatever offset built up since the last adjustment, beyond what that
+// one left behind, is the frequency error. It is only trusted if the
+// error bounds of both offsets allow to resolve it to 5ppm, which needs
+// the boundary search or X-Httpdate peers with plain 1s Date headers.
+void clock_discipline::track(int64_t offset, int64_t error)
+{
+	int64_t now = mono_usec();
+
+	if (last_adjust > 0 && now - last_adjust >= 60*1000000) {
+		double dt = (double)(now - last_adjust)/1000000;
+		double ppm = (double)(offset - residual)/dt;
+		double unc = (double)(error + last_error)/dt;
+
+		if (unc < 5)
+			set_frequency(freq_known ? freq + ppm/2 : freq + ppm);
+	}
+
+	last_adjust = now;
+	last_error = error;
+
+	// stepped or being slewed away
+	residual = 0;
+}
+
+
+// Hand the learned frequency to the kernel again, in case something else
+// touched it, when no server could be reached.
+int clock_discipline::holdover()
+{
+	if (!freq_known)
+		return -1;
+	if (slew)
+		return 0;
+	return set_frequency(freq);
+}
+
+
+// Returns CLOCK_SLEWED or CLOCK_STEPPED, -1 on error
+int clock_discipline::adjust(int64_t offset, int64_t error)
+{
+	int r = 0;
+
+	if (!slew || llabs(offset) > step_threshold) {
+		// the kernel PLL does its own frequency tracking
+		if (!slew)
+			track(offset, error);
+		if ((r = step(offset)) < 0)
+			return r;
+		save();
+		return r;
+	}
+
+#ifdef __linux__
+	struct timex tx;
+	memset(&tx, 0, sizeof(tx));
+
+	// usec offsets, the kernel PLL takes care of the frequency
+	tx.modes = ADJ_OFFSET|ADJ_STATUS|ADJ_TIMECONST;
+	tx.offset = offset;
+	tx.status = STA_PLL;
+	if (fll)
+		tx.status |= STA_FLL;
+	tx.constant = time_constant;
+
+	if (adjtimex(&tx) < 0) {
+		e = "clock_discipline::adjust::adjtimex:";
+		e += strerror(errno);
+		return -1;
+	}
+
+	// scaled ppm, 16 bit fraction
+	freq = (double)tx.freq/65536.0;
+	freq_known = 1;
+	save();
+#else
+	struct timeval tv;
+	tv.tv_sec = offset/1000000;
+	tv.tv_usec = offset%1000000;
+	if (adjtime(&tv, NULL) < 0) {
+		e = "clock_discipline::adjust::adjtime:";
+		e += strerror(errno);
+		return -1;
+	}
+#endif
+
+	return CLOCK_SLEWED;
+}
+
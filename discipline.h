@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __discipline_h__
+#define __discipline_h__
+
+#include <string>
+#include <stdint.h>
+
+
+// Brings the local clock in line with a measured offset. Either steps
+// it, or - in slew mode - hands small offsets to the kernel PLL so the
+// clock is smoothly and monotonically pulled in. Offsets beyond the step
+// threshold are always stepped. Needs nothing but CAP_SYS_TIME.
+// In step mode a frequency tracker learns the drift of the oscillator
+// from successive offsets and hands it to the kernel, so the clock keeps
+// good time between rounds and while no server is reachable.
+class clock_discipline {
+
+	bool slew;
+
+	// usec
+	int64_t step_threshold;
+
+	// PLL time constant, log2 seconds
+	int time_constant;
+
+	bool fll;
+
+	// kernel frequency correction in ppm, as read back after each update
+	// or as estimated by the tracker
+	double freq;
+	bool freq_known;
+
+	// Frequency tracker for step mode: CLOCK_MONOTONIC usec of the last
+	// adjustment, the offset it left and its error bound, usec
+	int64_t last_adjust, residual, last_error;
+
+	// kept open across chroot and privilege drop
+	int drift_fd;
+
+	std::string e;
+
+	int step(int64_t);
+
+	int set_frequency(double);
+
+	void track(int64_t, int64_t);
+
+	int save();
+
+public:
+
+	enum {
+		CLOCK_SLEWED = 0,
+		CLOCK_STEPPED = 1
+	};
+
+	clock_discipline();
+
+	virtual ~clock_discipline();
+
+	void slewing(bool b)
+	{
+		slew = b;
+	}
+
+	void threshold(int64_t);
+
+	void interval(int);
+
+	int adjust(int64_t, int64_t);
+
+	int drift(const std::string &);
+
+	int holdover();
+
+	double frequency()
+	{
+		return freq;
+	}
+
+	bool frequency_known()
+	{
+		return freq_known;
+	}
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+#endif
+
@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "misc.h"
+#include "poller.h"
+#include "dns.h"
+
+
+using namespace std;
+
+
+namespace {
+
+enum {
+	DNS_TYPE_A	= 1,
+	DNS_TYPE_AAAA	= 28,
+	DNS_CLASS_IN	= 1
+};
+
+// never trust a TTL beyond these, so a name is neither hammered nor frozen
+const uint32_t min_ttl = 60, max_ttl = 24*60*60, neg_ttl = 300;
+
+// per nameserver, before asking the next one
+const int retry_msec = 1000;
+
+
+struct query {
+	string name;
+	uint16_t type;
+	size_t server, cand;
+	int64_t sent;
+};
+
+
+// [0] for A, [1] for AAAA
+struct result {
+	vector<string> addrs[2];
+	uint32_t ttl[2];
+	bool answered[2];
+
+	result()
+	{
+		ttl[0] = ttl[1] = max_ttl;
+		answered[0] = answered[1] = 0;
+	}
+};
+
+
+int encode_name(const string &name, string &out)
+{
+	string::size_type s = 0, dot = 0;
+
+	out = "";
+	if (name.empty() || name.size() > 253)
+		return -1;
+
+	for (;;) {
+		dot = name.find('.', s);
+		string label = name.substr(s, dot == string::npos ? string::npos : dot - s);
+		if (label.size() > 63)
+			return -1;
+		// trailing dot
+		if (label.empty() && dot == string::npos)
+			break;
+		if (label.empty())
+			return -1;
+		out += (char)label.size();
+		out += label;
+		if (dot == string::npos)
+			break;
+		s = dot + 1;
+	}
+	out += (char)0;
+	return 0;
+}
+
+
+// advance past a possibly compressed name
+int skip_name(const unsigned char *buf, size_t len, size_t &off)
+{
+	while (off < len) {
+		unsigned char l = buf[off];
+		if ((l & 0xc0) == 0xc0) {
+			off += 2;
+			return off <= len ? 0 : -1;
+		}
+		if (l & 0xc0)
+			return -1;
+		++off;
+		if (l == 0)
+			return 0;
+		off += l;
+	}
+	return -1;
+}
+
+
+uint16_t get16(const unsigned char *p)
+{
+	return (uint16_t)(p[0]<<8|p[1]);
+}
+
+
+uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0]<<24|(uint32_t)p[1]<<16|(uint32_t)p[2]<<8|p[3];
+}
+
+
+bool same_addr(const struct sockaddr_storage &a, socklen_t alen, const struct sockaddr_storage &b, socklen_t blen)
+{
+	if (a.ss_family != b.ss_family)
+		return 0;
+	if (a.ss_family == AF_INET) {
+		const struct sockaddr_in *x = (const struct sockaddr_in *)&a, *y = (const struct sockaddr_in *)&b;
+		return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+	}
+	if (a.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)&a, *y = (const struct sockaddr_in6 *)&b;
+		return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+	}
+	return alen == blen && memcmp(&a, &b, alen) == 0;
+}
+
+}
+
+
+dns_resolver::dns_resolver() : ndots(1), rnd(0), e("")
+{
+}
+
+
+dns_resolver::~dns_resolver()
+{
+}
+
+
+// xorshift32; only needs to be unpredictable enough for query IDs
+uint16_t dns_resolver::next_id()
+{
+	rnd ^= rnd<<13;
+	rnd ^= rnd>>17;
+	rnd ^= rnd<<5;
+	return (uint16_t)(rnd>>8);
+}
+
+
+// Must be called before chroot
+int dns_resolver::init(const char *resolv_conf)
+{
+	FILE *f = NULL;
+	char buf[512], addr[256];
+	struct addrinfo hints, *ai = NULL;
+	nameserver n;
+
+	ns.clear();
+	search.clear();
+	if ((f = fopen(resolv_conf, "r")) == NULL) {
+		e = "dns_resolver::init::fopen:";
+		e += strerror(errno);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		// the last search or domain line wins, as with the libc resolver
+		if ((strncmp(buf, "search", 6) == 0 || strncmp(buf, "domain", 6) == 0) && isspace(buf[6])) {
+			search.clear();
+			for (char *t = strtok(buf + 6, " \t\r\n"); t != NULL && search.size() < 6; t = strtok(NULL, " \t\r\n"))
+				search.push_back(t);
+			continue;
+		}
+		if (strncmp(buf, "options", 7) == 0 && strstr(buf, "ndots:") != NULL) {
+			ndots = strtoul(strstr(buf, "ndots:") + 6, NULL, 10);
+			if (ndots > 15)
+				ndots = 15;
+			continue;
+		}
+		if (ns.size() >= 3 || sscanf(buf, "nameserver %255s", addr) != 1)
+			continue;
+		if (getaddrinfo(addr, "53", &hints, &ai) != 0)
+			continue;
+		if (ai->ai_addrlen <= sizeof(n.addr)) {
+			memset(&n.addr, 0, sizeof(n.addr));
+			memcpy(&n.addr, ai->ai_addr, ai->ai_addrlen);
+			n.len = ai->ai_addrlen;
+			ns.push_back(n);
+		}
+		freeaddrinfo(ai);
+	}
+	fclose(f);
+
+	if (ns.empty()) {
+		e = "dns_resolver::init: no nameserver in ";
+		e += resolv_conf;
+		return -1;
+	}
+
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, &rnd, sizeof(rnd)) != sizeof(rnd))
+		rnd = (uint32_t)(getpid() ^ mono_usec());
+	if (fd >= 0)
+		close(fd);
+	if (rnd == 0)
+		rnd = 1;
+
+	return 0;
+}
+
+
+// the names to ask for, in order; absolute ones are taken as they are
+void dns_resolver::candidates(const string &name, vector<string> &v)
+{
+	vector<string> all;
+	string qname = "";
+	size_t dots = 0;
+
+	for (string::size_type i = 0; i < name.size(); ++i)
+		dots += name[i] == '.';
+
+	bool absolute = name.empty() || name[name.size() - 1] == '.';
+	if (absolute || dots >= ndots)
+		all.push_back(name);
+	for (vector<string>::iterator i = search.begin(); !absolute && i != search.end(); ++i)
+		all.push_back(name + "." + *i);
+	if (!absolute && dots < ndots)
+		all.push_back(name);
+
+	v.clear();
+	for (vector<string>::iterator i = all.begin(); i != all.end(); ++i) {
+		if (encode_name(*i, qname) == 0)
+			v.push_back(*i);
+	}
+}
+
+
+// addresses we already know, e.g. from getaddrinfo() at startup
+void dns_resolver::seed(const string &name, const vector<string> &addrs, int ttl)
+{
+	entry &en = cache[name];
+	en.addrs[0].clear();
+	en.addrs[1].clear();
+	for (vector<string>::const_iterator i = addrs.begin(); i != addrs.end(); ++i)
+		en.addrs[i->find(':') != string::npos].push_back(*i);
+	en.expires = mono_usec() + (int64_t)ttl*1000000;
+}
+
+
+bool dns_resolver::expired(const string &name)
+{
+	map<string, entry>::iterator i = cache.find(name);
+	return i == cache.end() || i->second.expires <= mono_usec();
+}
+
+
+int dns_resolver::lookup(const string &name, vector<string> &addrs)
+{
+	map<string, entry>::iterator i = cache.find(name);
+	if (i == cache.end() || (i->second.addrs[0].empty() && i->second.addrs[1].empty()))
+		return -1;
+	addrs = i->second.addrs[0];
+	addrs.insert(addrs.end(), i->second.addrs[1].begin(), i->second.addrs[1].end());
+	return 0;
+}
+
+
+// Query A and AAAA for all names in parallel, waiting at most msec.
+// Relative names walk the search list until one is not NXDOMAIN. A family
+// without an answer keeps its cached addresses and is retried soon, names
+// still pending when time is up right at the next call.
+// Returns the number of names with fresh answers.
+int dns_resolver::resolve(const vector<string> &names, int msec)
+{
+	if (ns.empty() || names.empty())
+		return 0;
+
+	poller p;
+	vector<poller::event> ev;
+	map<uint16_t, query> pending;
+	map<string, result> results;
+	map<string, vector<string> > cands;
+	int fds[2] = {-1, -1};
+	unsigned char pkt[1500];
+	string qname = "";
+
+	if (p.init() < 0) {
+		e = "dns_resolver::resolve::";
+		e += p.why();
+		return -1;
+	}
+
+	// one unconnected socket per family, the kernel picks random ports
+	for (size_t i = 0; i < ns.size(); ++i) {
+		int idx = ns[i].addr.ss_family == AF_INET6 ? 1 : 0;
+		if (fds[idx] >= 0)
+			continue;
+		if ((fds[idx] = socket(ns[i].addr.ss_family, SOCK_DGRAM, 0)) < 0)
+			continue;
+		// not nonblock(), which also wants TCP_NODELAY
+		if (fcntl(fds[idx], F_SETFL, fcntl(fds[idx], F_GETFL)|O_NONBLOCK) < 0 ||
+		    p.add(fds[idx], poller::POLL_IN) < 0) {
+			close(fds[idx]);
+			fds[idx] = -1;
+		}
+	}
+
+	int64_t now = mono_usec(), end = now + (int64_t)msec*1000;
+
+	for (vector<string>::const_iterator i = names.begin(); i != names.end(); ++i) {
+		candidates(*i, cands[*i]);
+		if (cands[*i].empty())
+			continue;
+		results[*i];
+		for (int t = 0; t < 2; ++t) {
+			query q;
+			q.name = *i;
+			q.type = t == 0 ? DNS_TYPE_A : DNS_TYPE_AAAA;
+			q.server = 0;
+			q.cand = 0;
+			q.sent = 0;
+			uint16_t id = next_id();
+			while (pending.count(id) > 0)
+				id = next_id();
+			pending[id] = q;
+		}
+	}
+
+	while (!pending.empty() && (now = mono_usec()) < end) {
+		int64_t next = end;
+
+		// (re)send whatever is due, moving on to the next nameserver
+		for (map<uint16_t, query>::iterator i = pending.begin(); i != pending.end();) {
+			query &q = i->second;
+			if (q.sent != 0 && now - q.sent >= (int64_t)retry_msec*1000) {
+				q.sent = 0;
+				++q.server;
+			}
+			if (q.server >= ns.size()) {
+				pending.erase(i++);
+				continue;
+			}
+			if (q.sent == 0) {
+				int fd = fds[ns[q.server].addr.ss_family == AF_INET6 ? 1 : 0];
+				encode_name(cands[q.name][q.cand], qname);
+				size_t len = 12 + qname.size() + 4;
+				memset(pkt, 0, 12);
+				pkt[0] = i->first>>8;
+				pkt[1] = i->first & 0xff;
+				pkt[2] = 0x01;		// RD
+				pkt[5] = 1;		// QDCOUNT
+				memcpy(pkt + 12, qname.c_str(), qname.size());
+				pkt[12 + qname.size()] = q.type>>8;
+				pkt[13 + qname.size()] = q.type & 0xff;
+				pkt[14 + qname.size()] = 0;
+				pkt[15 + qname.size()] = DNS_CLASS_IN;
+				if (fd < 0 || sendto(fd, pkt, len, 0, (struct sockaddr *)&ns[q.server].addr, ns[q.server].len) < 0)
+					q.sent = now - (int64_t)retry_msec*1000;
+				else
+					q.sent = now;
+			}
+			if (q.sent + (int64_t)retry_msec*1000 < next)
+				next = q.sent + (int64_t)retry_msec*1000;
+			++i;
+		}
+		if (pending.empty())
+			break;
+
+		if (p.wait(ev, next > now ? (int)((next - now + 999)/1000) : 0) < 0)
+			break;
+
+		for (vector<poller::event>::iterator i = ev.begin(); i != ev.end(); ++i) {
+			struct sockaddr_storage from;
+			socklen_t flen = sizeof(from);
+			ssize_t n = 0;
+			while ((n = recvfrom(i->fd, pkt, sizeof(pkt), 0, (struct sockaddr *)&from, &flen)) > 0) {
+				flen = sizeof(from);
+				if (n < 12)
+					continue;
+				map<uint16_t, query>::iterator qi = pending.find(get16(pkt));
+				if (qi == pending.end())
+					continue;
+				query &q = qi->second;
+
+				// only the nameserver we asked may answer, with our question
+				if (!same_addr(from, flen, ns[q.server].addr, ns[q.server].len))
+					continue;
+				encode_name(cands[q.name][q.cand], qname);
+				if (!(pkt[2] & 0x80) || get16(pkt + 4) != 1 || (size_t)n < 12 + qname.size() + 4 ||
+				    strncasecmp((const char *)pkt + 12, qname.c_str(), qname.size()) != 0 ||
+				    get16(pkt + 12 + qname.size()) != q.type)
+					continue;
+
+				result &r = results[q.name];
+				int rcode = pkt[3] & 0x0f, fam = q.type == DNS_TYPE_AAAA;
+
+				// NXDOMAIN is an answer too, but SERVFAIL et al. are not
+				if (rcode != 0 && rcode != 3) {
+					q.sent = 0;
+					++q.server;
+					continue;
+				}
+
+				// no such name, so on to the next search domain under a new ID
+				if (rcode == 3 && q.cand + 1 < cands[q.name].size()) {
+					query nq = q;
+					++nq.cand;
+					nq.server = 0;
+					nq.sent = 0;
+					pending.erase(qi);
+					uint16_t id = next_id();
+					while (pending.count(id) > 0)
+						id = next_id();
+					pending[id] = nq;
+					continue;
+				}
+				r.answered[fam] = 1;
+
+				size_t off = 12 + qname.size() + 4;
+				uint16_t an = get16(pkt + 6);
+				char addr[INET6_ADDRSTRLEN];
+				for (uint16_t j = 0; rcode == 0 && j < an; ++j) {
+					if (skip_name(pkt, n, off) < 0 || off + 10 > (size_t)n)
+						break;
+					uint16_t type = get16(pkt + off), cls = get16(pkt + off + 2), rdlen = get16(pkt + off + 8);
+					uint32_t ttl = get32(pkt + off + 4);
+					off += 10;
+					if (off + rdlen > (size_t)n)
+						break;
+					if (cls == DNS_CLASS_IN && type == q.type &&
+					    ((type == DNS_TYPE_A && rdlen == 4) || (type == DNS_TYPE_AAAA && rdlen == 16))) {
+						if (inet_ntop(type == DNS_TYPE_A ? AF_INET : AF_INET6, pkt + off, addr, sizeof(addr))) {
+							r.addrs[fam].push_back(addr);
+							if (ttl < r.ttl[fam])
+								r.ttl[fam] = ttl;
+						}
+					}
+					off += rdlen;
+				}
+				pending.erase(qi);
+			}
+		}
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	// cut short by msec rather than failed, so not held back by neg_ttl
+	map<string, bool> cut;
+	for (map<uint16_t, query>::iterator i = pending.begin(); i != pending.end(); ++i)
+		cut[i->second.name] = 1;
+
+	int fresh = 0;
+	now = mono_usec();
+	for (map<string, result>::iterator i = results.begin(); i != results.end(); ++i) {
+		result &r = i->second;
+		entry &en = cache[i->first];
+		if (r.addrs[0].empty() && r.addrs[1].empty()) {
+			// keep serving stale addresses rather than none
+			if (!cut[i->first])
+				en.expires = now + (int64_t)neg_ttl*1000000;
+			continue;
+		}
+
+		uint32_t ttl = max_ttl;
+		for (int f = 0; f < 2; ++f) {
+			if (!r.answered[f])
+				continue;
+			en.addrs[f] = r.addrs[f];
+			if (r.ttl[f] < ttl)
+				ttl = r.ttl[f];
+		}
+		if (ttl < min_ttl)
+			ttl = min_ttl;
+		// the family that timed out is asked again soon
+		if ((!r.answered[0] || !r.answered[1]) && ttl > neg_ttl)
+			ttl = neg_ttl;
+		en.expires = now + (int64_t)ttl*1000000;
+		++fresh;
+	}
+
+	return fresh;
+}
+
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __dns_h__
+#define __dns_h__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+// Minimal stub resolver speaking UDP DNS to the nameservers from
+// resolv.conf. The nameservers and search list are read once at startup,
+// so it keeps working inside the chroot where getaddrinfo() has no config
+// files. Answers are cached for as long as their TTL says.
+class dns_resolver {
+
+	struct nameserver {
+		struct sockaddr_storage addr;
+		socklen_t len;
+	};
+
+	std::vector<nameserver> ns;
+
+	// from search or domain, tried for names with fewer than ndots dots
+	std::vector<std::string> search;
+
+	size_t ndots;
+
+	struct entry {
+		// A and AAAA apart, so a family that fails keeps its addresses
+		std::vector<std::string> addrs[2];
+
+		// CLOCK_MONOTONIC usec
+		int64_t expires;
+	};
+
+	std::map<std::string, entry> cache;
+
+	uint32_t rnd;
+
+	std::string e;
+
+	uint16_t next_id();
+
+	void candidates(const std::string &, std::vector<std::string> &);
+
+public:
+
+	dns_resolver();
+
+	virtual ~dns_resolver();
+
+	int init(const char *);
+
+	bool enabled()
+	{
+		return !ns.empty();
+	}
+
+	void seed(const std::string &, const std::vector<std::string> &, int);
+
+	bool expired(const std::string &);
+
+	int resolve(const std::vector<std::string> &, int);
+
+	int lookup(const std::string &, std::vector<std::string> &);
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+#endif
+
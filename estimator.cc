@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdint.h>
+#include "estimator.h"
+
+
+namespace Estimator {
+
+using namespace std;
+
+
+namespace {
+
+struct edge {
+	int64_t v;
+
+	// +1 opens an interval, -1 closes it
+	int type;
+
+	int weight;
+
+	bool operator<(const edge &o) const
+	{
+		// closed intervals: open before close on ties
+		if (v != o.v)
+			return v < o.v;
+		return type > o.type;
+	}
+};
+
+
+// Marzullo: sweep over all interval edges and find the region covered by
+// the most samples, by weight. Only a majority makes it trustworthy; the
+// samples not overlapping it are falsetickers.
+int intersect(const vector<interval> &vi, result &r)
+{
+	vector<edge> edges;
+	edges.reserve(2*vi.size());
+
+	edge e;
+	int64_t total = 0;
+	for (vector<interval>::const_iterator i = vi.begin(); i != vi.end(); ++i) {
+		total += i->weight;
+		e.weight = i->weight;
+		e.v = i->offset - i->error;
+		e.type = 1;
+		edges.push_back(e);
+		e.v = i->offset + i->error;
+		e.type = -1;
+		edges.push_back(e);
+	}
+	sort(edges.begin(), edges.end());
+
+	int64_t count = 0, best = 0, lo = 0, hi = 0;
+	size_t n = 0, used = 0;
+	for (size_t i = 0; i < edges.size(); ++i) {
+		if (edges[i].type > 0) {
+			++n;
+			if ((count += edges[i].weight) > best) {
+				best = count;
+				used = n;
+				lo = edges[i].v;
+				hi = edges[i + 1].v;
+			}
+		} else {
+			--n;
+			count -= edges[i].weight;
+		}
+	}
+
+	if (2*best <= total)
+		return -1;
+
+	r.offset = lo + (hi - lo)/2;
+	r.error = (hi - lo)/2;
+	r.used = used;
+	return 0;
+}
+
+
+// Rough one sigma bound for a location estimate over the sorted offsets
+// [b, e): robust spread of the offsets plus the mean sample error,
+// shrinking with the number of samples.
+int64_t bound(const vector<interval> &vs, size_t b, size_t e, int64_t center)
+{
+	vector<int64_t> dev;
+	int64_t err = 0;
+	for (size_t i = b; i < e; ++i) {
+		dev.push_back(llabs(vs[i].offset - center));
+		err += vs[i].error;
+	}
+	size_t n = e - b;
+	nth_element(dev.begin(), dev.begin() + n/2, dev.end());
+
+	// MAD scaled to a standard deviation
+	double sigma = 1.4826*dev[n/2];
+	return (int64_t)((sigma + (double)err/n)/sqrt((double)n));
+}
+
+
+bool by_offset(const interval &a, const interval &b)
+{
+	return a.offset < b.offset;
+}
+
+
+// weighted, as if every sample was there weight times
+int median(const vector<interval> &vi, result &r)
+{
+	vector<interval> vs = vi;
+	sort(vs.begin(), vs.end(), by_offset);
+
+	size_t n = vs.size(), k = 0;
+	int64_t total = 0, c = 0;
+	for (size_t i = 0; i < n; ++i)
+		total += vs[i].weight;
+	for (k = 0; k < n - 1; ++k) {
+		if (2*(c += vs[k].weight) >= total)
+			break;
+	}
+	if (2*c == total && k + 1 < n)
+		r.offset = vs[k].offset + (vs[k + 1].offset - vs[k].offset)/2;
+	else
+		r.offset = vs[k].offset;
+	r.error = bound(vs, 0, n, r.offset);
+	r.used = n;
+	return 0;
+}
+
+
+// interquartile mean: drop the lowest and highest quarter by weight,
+// a sample on the edge counting with the part of its weight inside
+int trimmed(const vector<interval> &vi, result &r)
+{
+	vector<interval> vs = vi;
+	sort(vs.begin(), vs.end(), by_offset);
+
+	size_t n = vs.size(), b = n, e = 0;
+	int64_t total = 0, c = 0, sum = 0;
+	for (size_t i = 0; i < n; ++i)
+		total += vs[i].weight;
+	int64_t lo = total/4, hi = total - total/4;
+	for (size_t i = 0; i < n; c += vs[i].weight, ++i) {
+		int64_t w = min(c + vs[i].weight, hi) - max(c, lo);
+		if (w <= 0)
+			continue;
+		sum += w*vs[i].offset;
+		b = min(b, i);
+		e = i + 1;
+	}
+	r.offset = sum/(hi - lo);
+	r.error = bound(vs, b, e, r.offset);
+	r.used = e - b;
+	return 0;
+}
+
+}
+
+
+int parse(const string &s, estimator_t &est)
+{
+	if (s == "intersect")
+		est = EST_INTERSECT;
+	else if (s == "median")
+		est = EST_MEDIAN;
+	else if (s == "trimmed")
+		est = EST_TRIMMED;
+	else
+		return -1;
+	return 0;
+}
+
+
+const char *name(estimator_t est)
+{
+	switch (est) {
+	case EST_MEDIAN:
+		return "median";
+	case EST_TRIMMED:
+		return "trimmed";
+	default:
+		return "intersect";
+	}
+}
+
+
+// O(n log n) in the number of samples. Returns -1 if the samples do
+// not allow for a result, e.g. there is no majority agreeing.
+int estimate(estimator_t est, const vector<interval> &vi, result &r)
+{
+	if (vi.empty())
+		return -1;
+
+	switch (est) {
+	case EST_MEDIAN:
+		return median(vi, r);
+	case EST_TRIMMED:
+		return trimmed(vi, r);
+	default:
+		return intersect(vi, r);
+	}
+}
+
+}
+
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#include "filter.h"
+
+
+clock_filter::clock_filter() : n(0), next(0)
+{
+	memset(offset, 0, sizeof(offset));
+	memset(delay, 0, sizeof(delay));
+	memset(error, 0, sizeof(error));
+	memset(when, 0, sizeof(when));
+	memset(applied, 0, sizeof(applied));
+	memset(stratum, 0, sizeof(stratum));
+}
+
+
+// Shift in a sample: offset, delay, error, stratum, when and the
+// corrections applied until then
+void clock_filter::add(int64_t o, int64_t d, int64_t e, int s, int64_t w, int64_t a)
+{
+	offset[next] = o;
+	delay[next] = d;
+	error[next] = e;
+	stratum[next] = s;
+	when[next] = w;
+	applied[next] = a;
+	next = (next + 1) % STAGES;
+	if (n < STAGES)
+		++n;
+}
+
+
+// The stage with the lowest distance, i.e. half its delay plus the
+// 15ppm its error grew by since it was taken, given the time now and
+// the corrections applied by now. jitter is the RMS of the offsets of
+// all stages from that one. -1 if the register is empty.
+int clock_filter::select(int64_t now, int64_t now_applied, int64_t &jitter) const
+{
+	int best = -1;
+	int64_t dist = 0;
+
+	jitter = 0;
+	for (int i = 0; i < n; ++i) {
+		int64_t d = delay[i]/2 + (now - when[i])*15/1000000;
+		if (best < 0 || d < dist) {
+			best = i;
+			dist = d;
+		}
+	}
+	if (best < 0 || n < 2)
+		return best;
+
+	// offsets relative to the current clock
+	int64_t o = offset[best] - (now_applied - applied[best]);
+	double sum = 0;
+	for (int i = 0; i < n; ++i) {
+		if (i == best)
+			continue;
+		double dev = (double)(offset[i] - (now_applied - applied[i]) - o);
+		sum += dev*dev;
+	}
+	jitter = (int64_t)sqrt(sum/(n - 1));
+	return best;
+}
+
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __filter_h__
+#define __filter_h__
+
+#include <stdint.h>
+
+
+// NTP style clock filter: a shift register of the last samples of one
+// server, from which the one with the lowest delay is picked, as that
+// one suffered the least from queueing on the path.
+class clock_filter {
+
+public:
+
+	enum {
+		STAGES	= 8
+	};
+
+	// Per stage, in usec. when is CLOCK_MONOTONIC at the sample and
+	// applied the sum of clock corrections made until then.
+	int64_t offset[STAGES], delay[STAGES], error[STAGES], when[STAGES], applied[STAGES];
+	int stratum[STAGES];
+
+	// stages in use, and the one to overwrite next
+	int n, next;
+
+	clock_filter();
+
+	void add(int64_t, int64_t, int64_t, int, int64_t, int64_t);
+
+	int select(int64_t, int64_t, int64_t &) const;
+
+	// CLOCK_MONOTONIC usec of the newest sample, 0 for none
+	int64_t last() const
+	{
+		return n > 0 ? when[(next + STAGES - 1) % STAGES] : 0;
+	}
+};
+
+
+#endif
+
@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "log.h"
+#include "misc.h"
+#include "httpd.h"
+
+
+using namespace std;
+
+
+date_server::date_server() : lfd(-1), rendered(0), keep(""), closing(""), bad(""), unsynced(""), stratum(16),
+                             error(0), synced(0), e("")
+{
+	// RFC 9110 wants no Date from a server without a clock it can trust
+	unsynced = "HTTP/1.1 503 Service Unavailable\r\nServer: httpdated\r\nRetry-After: 10\r\n"
+	           "Content-Length: 0\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+}
+
+
+date_server::~date_server()
+{
+	if (lfd >= 0)
+		close(lfd);
+	for (size_t i = 0; i < conns.size(); ++i) {
+		if (conns[i].open)
+			close(i);
+	}
+}
+
+
+int date_server::listen(const string &port)
+{
+	struct addrinfo *ai = NULL, hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	// one IPv6 socket for both families if possible
+	int r = 0, one = 1, zero = 0;
+	hints.ai_family = AF_INET6;
+	if ((r = getaddrinfo(NULL, port.c_str(), &hints, &ai)) != 0) {
+		hints.ai_family = AF_INET;
+		if ((r = getaddrinfo(NULL, port.c_str(), &hints, &ai)) != 0) {
+			e = "date_server::listen::getaddrinfo:";
+			e += gai_strerror(r);
+			return -1;
+		}
+	}
+
+	if ((lfd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0 && ai->ai_family == AF_INET6) {
+		freeaddrinfo(ai);
+		hints.ai_family = AF_INET;
+		if ((r = getaddrinfo(NULL, port.c_str(), &hints, &ai)) != 0) {
+			e = "date_server::listen::getaddrinfo:";
+			e += gai_strerror(r);
+			return -1;
+		}
+		lfd = socket(ai->ai_family, SOCK_STREAM, 0);
+	}
+	if (lfd < 0) {
+		freeaddrinfo(ai);
+		e = "date_server::listen::socket:";
+		e += strerror(errno);
+		return -1;
+	}
+
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (ai->ai_family == AF_INET6)
+		setsockopt(lfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+	if (::bind(lfd, ai->ai_addr, ai->ai_addrlen) < 0 || ::listen(lfd, 1024) < 0 || nonblock(lfd) < 0) {
+		freeaddrinfo(ai);
+		e = "date_server::listen::bind:";
+		e += strerror(errno);
+		close(lfd);
+		lfd = -1;
+		return -1;
+	}
+	freeaddrinfo(ai);
+	return 0;
+}
+
+
+int date_server::start()
+{
+	if (p.init() < 0 || p.add(lfd, poller::POLL_IN) < 0) {
+		e = "date_server::start::";
+		e += p.why();
+		return -1;
+	}
+
+	if ((errno = pthread_create(&tid, NULL, thread, this)) != 0) {
+		e = "date_server::start::pthread_create:";
+		e += strerror(errno);
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+
+void *date_server::thread(void *vp)
+{
+	static_cast<date_server *>(vp)->run();
+	return NULL;
+}
+
+
+// Not strftime(), whose names depend on the locale
+void date_server::render(time_t now)
+{
+	static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	                               "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	struct tm tm;
+	char date[64];
+
+	gmtime_r(&now, &tm);
+	snprintf(date, sizeof(date), "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n", days[tm.tm_wday],
+	         tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+	keep = "HTTP/1.1 200 OK\r\n";
+	keep += date;
+	keep += "Server: httpdated\r\nContent-Length: 0\r\nCache-Control: no-cache\r\n";
+
+	closing = "HTTP/1.1 200 OK\r\n";
+	closing += date;
+	closing += "Server: httpdated\r\nContent-Length: 0\r\nCache-Control: no-cache\r\nConnection: close\r\n";
+
+	bad = "HTTP/1.1 405 Method Not Allowed\r\n";
+	bad += date;
+	bad += "Server: httpdated\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+	rendered = now;
+}
+
+
+// Called after every round, also those that did not adjust the clock, so
+// the error keeps aging from the last adjustment in hires()
+void date_server::sync(int s, int64_t err, int64_t when)
+{
+	error = err;
+	synced = when;
+	stratum = s + 1 > 16 ? 16 : s + 1;
+}
+
+
+// Finish a response with our receive and transmit time. The error grows
+// by 15ppm of the time since the last sync, as in NTP.
+void date_server::hires(string &out, int64_t rx, int64_t tx)
+{
+	char buf[128];
+	int s = stratum;
+	int64_t err = error + (mono_usec() - synced)*15/1000000;
+
+	snprintf(buf, sizeof(buf), "X-Httpdate: rx=%lld.%06lld tx=%lld.%06lld stratum=%d error=%lld.%06lld\r\n\r\n",
+	         (long long)(rx/1000000), (long long)(rx%1000000), (long long)(tx/1000000), (long long)(tx%1000000),
+	         s, (long long)(err/1000000), (long long)(err%1000000));
+	out += buf;
+}
+
+
+void date_server::drop(int fd)
+{
+	p.del(fd);
+	close(fd);
+	conns[fd].open = 0;
+	conns[fd].in.clear();
+	conns[fd].out.clear();
+}
+
+
+void date_server::expire(int64_t now)
+{
+	for (size_t i = 0; i < conns.size(); ++i) {
+		if (conns[i].open && now - conns[i].last > (int64_t)idle_limit*1000000)
+			drop(i);
+	}
+}
+
+
+void date_server::accept_all()
+{
+	int fd = -1;
+
+	for (int i = 0; i < 64; ++i) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+				Log::log(Log::HTTPDATE_WARNING, "date_server::accept:%s", strerror(errno));
+			return;
+		}
+		if (nonblock(fd) < 0 || p.add(fd, poller::POLL_IN) < 0) {
+			close(fd);
+			continue;
+		}
+		if ((size_t)fd >= conns.size())
+			conns.resize(fd + 1);
+		conn &c = conns[fd];
+		c.open = 1;
+		c.close = 0;
+		c.out_wait = 0;
+		c.last = mono_usec();
+	}
+}
+
+
+// Does the header block [p, end) carry a Connection header with tok?
+static bool connection_has(const char *p, const char *end, const char *tok)
+{
+	size_t tl = strlen(tok);
+
+	for (; p < end; ++p) {
+		const char *nl = (const char *)memchr(p, '\n', end - p);
+		if (nl == NULL)
+			return 0;
+		p = nl + 1;
+		if (end - p < 11 || strncasecmp(p, "connection:", 11) != 0)
+			continue;
+		nl = (const char *)memchr(p, '\n', end - p);
+		for (const char *v = p + 11; nl && v + tl <= nl; ++v) {
+			if (strncasecmp(v, tok, tl) == 0)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+
+void date_server::handle(int fd, int what)
+{
+	conn &c = conns[fd];
+	char buf[4096];
+	ssize_t r = 0;
+	int64_t rx = 0, tx = 0;
+
+	if (what & poller::POLL_IN) {
+		for (;;) {
+			if ((r = read(fd, buf, sizeof(buf))) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				if (errno == EINTR)
+					continue;
+				drop(fd);
+				return;
+			}
+			if (r == 0) {
+				drop(fd);
+				return;
+			}
+			if (rx == 0)
+				rx = real_usec();
+			c.in.append(buf, r);
+			if ((size_t)r < sizeof(buf))
+				break;
+		}
+		c.last = mono_usec();
+
+		// answer all complete, possibly pipelined, requests. They are
+		// written right after, so that is what tx stands for.
+		tx = real_usec();
+		string::size_type hdr_end = 0, start = 0;
+		while (!c.close && (hdr_end = c.in.find("\r\n\r\n", start)) != string::npos) {
+			const char *req = c.in.data() + start, *end = c.in.data() + hdr_end + 2;
+			const char *eol = (const char *)memchr(req, '\n', end - req);
+			bool http10 = eol - req >= 9 && strncmp(eol - 9, "HTTP/1.0", 8) == 0;
+
+			if (synced == 0) {
+				c.out += unsynced;
+				c.close = 1;
+			} else if (strncmp(req, "HEAD ", 5) != 0 && strncmp(req, "GET ", 4) != 0) {
+				c.out += bad;
+				c.close = 1;
+			} else if (http10 ? !connection_has(req, end, "keep-alive") : connection_has(req, end, "close")) {
+				c.out += closing;
+				hires(c.out, rx, tx);
+				c.close = 1;
+			} else {
+				c.out += keep;
+				hires(c.out, rx, tx);
+			}
+			start = hdr_end + 4;
+		}
+		c.in.erase(0, start);
+		if (c.in.size() > max_request && !c.close) {
+			c.out += synced == 0 ? unsynced : bad;
+			c.close = 1;
+		}
+	}
+
+	if (!c.out.empty()) {
+		if ((r = write(fd, c.out.data(), c.out.size())) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			drop(fd);
+			return;
+		}
+		if (r > 0)
+			c.out.erase(0, r);
+	}
+
+	if (c.out.empty() && c.close) {
+		drop(fd);
+		return;
+	}
+	// only touch the poller if that changes anything
+	if (c.out_wait != !c.out.empty()) {
+		c.out_wait = !c.out.empty();
+		p.mod(fd, c.out_wait ? poller::POLL_IN|poller::POLL_OUT : poller::POLL_IN);
+	}
+}
+
+
+void date_server::run()
+{
+	vector<poller::event> ev;
+	int64_t now = 0;
+
+	for (;;) {
+		// re-render right after each full second of our clock
+		now = real_usec();
+		if (now/1000000 != rendered) {
+			render(now/1000000);
+			expire(mono_usec());
+		}
+
+		if (p.wait(ev, (int)((1000000 - now % 1000000)/1000) + 1) < 0) {
+			Log::log(Log::HTTPDATE_ERR, "date_server::run::%s", p.why());
+			return;
+		}
+
+		// a step of the clock may have crossed a second meanwhile
+		if (real_usec()/1000000 != rendered)
+			render(real_usec()/1000000);
+
+		for (vector<poller::event>::iterator i = ev.begin(); i != ev.end(); ++i) {
+			if (i->fd == lfd)
+				accept_all();
+			else if ((size_t)i->fd < conns.size() && conns[i->fd].open)
+				handle(i->fd, (i->what & poller::POLL_ERR) ? poller::POLL_IN : i->what);
+		}
+	}
+}
+
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __httpd_h__
+#define __httpd_h__
+
+#include <string>
+#include <vector>
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+
+#include "poller.h"
+
+
+// Minimal HTTP/1.1 server answering HEAD and GET with nothing but a
+// Date header taken from our own, disciplined clock. All connections
+// share one response rendered once per second. Until our clock was
+// adjusted once, requests get a 503 without a Date. Runs in a thread of
+// its own so that probing and sleeping never delay an answer.
+class date_server {
+
+	struct conn {
+		// in use, close after the response, waiting for POLL_OUT
+		bool open, close, out_wait;
+
+		// CLOCK_MONOTONIC usec of the last request
+		int64_t last;
+
+		// unparsed request bytes, unsent response bytes
+		std::string in, out;
+
+		conn() : open(0), close(0), out_wait(0), last(0), in(""), out("")
+		{
+		}
+	};
+
+	int lfd;
+	poller p;
+
+	// indexed by fd
+	std::vector<conn> conns;
+
+	// the second the responses below are valid for. keep and closing
+	// lack the empty line; the X-Httpdate header goes there.
+	time_t rendered;
+	std::string keep, closing, bad, unsynced;
+
+	// what we tell clients about our clock, set by the main thread.
+	// synced is CLOCK_MONOTONIC usec.
+	std::atomic<int> stratum;
+	std::atomic<int64_t> error, synced;
+
+	void hires(std::string &, int64_t, int64_t);
+
+	pthread_t tid;
+
+	std::string e;
+
+	void render(time_t);
+
+	void expire(int64_t);
+
+	void accept_all();
+
+	void drop(int);
+
+	void handle(int, int);
+
+	void run();
+
+	static void *thread(void *);
+
+public:
+
+	enum {
+		max_request	= 8192,
+		idle_limit	= 30
+	};
+
+	date_server();
+
+	virtual ~date_server();
+
+	// bind, as root and before chroot
+	int listen(const std::string &);
+
+	// spawn the serving thread, after fork()
+	int start();
+
+	// our clock was set from servers of the given stratum (1 for plain
+	// web servers) at the given CLOCK_MONOTONIC usec and was off by at
+	// most error usec then
+	void sync(int, int64_t, int64_t);
+
+	bool enabled() const
+	{
+		return lfd >= 0;
+	}
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+#endif
+
@@ -30,48 +30,175 @@
  * SUCH DAMAGE.
  */
 
+
 #include <vector>
+#include <queue>
 #include <cerrno>
+#include <climits>
 #include <cmath>
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
 #include <unistd.h>
 #include <algorithm>
 #include <functional>
 #include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
 
 #include "log.h"
 #include "misc.h"
+#include "poller.h"
+#include "parser.h"
 #include "httpdate.h"
 
+#ifdef USE_SSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
 
 using namespace std;
 
 
-bool operator<(struct addrinfo a1, struct addrinfo a2)
-{
-	return memcmp(&a1, &a2, sizeof(a1)) < 0;
+namespace {
+
+enum {
+	PROBE_CONNECT = 0,
+	PROBE_HANDSHAKE,
+	PROBE_WAIT,
+	PROBE_READ,
+	PROBE_DONE,
+	PROBE_FAILED
+};
+
+
+// why a probe failed, for the metrics
+enum {
+	FAIL_NONE = 0,
+	FAIL_CONNECT,
+	FAIL_TIMEOUT,
+	FAIL_READ,
+	FAIL_PARSE
+};
+
+
+// Log messages of a round queue up until it is over, so that no log
+// I/O gets between a measurement and the clock adjustment.
+struct log_hold {
+	log_hold()
+	{
+		Log::hold(1);
+	}
+
+	~log_hold()
+	{
+		Log::hold(0);
+	}
+};
+
+
+// state of a single server during one round
+struct probe {
+	const server_table *st;
+
+	// row in the server table
+	size_t idx;
+	int fd, state, fail;
+
+	// HTTP/1.1 request, whether the connection came from the pool and
+	// whether it is idle and may go back there
+	bool keep_alive, reused, reusable;
+
+	// CLOCK_MONOTONIC usec, except rt_send which is CLOCK_REALTIME.
+	// In PROBE_WAIT the deadline is when the next request is due.
+	int64_t deadline, t_send, t_recv, rt_send;
+
+	// whether the kernel stamped the segment carrying the last Date
+	bool stamped;
+
+	header_parser hp;
+
+#ifdef USE_SSL
+	// set for HTTPS servers; ssl once connected, with the kernel stamp
+	// of the record it currently reads from
+	tls_client *tls;
+	SSL *ssl;
+	int64_t tls_stamp;
+#endif
+
+	// Interval of offsets consistent with every Date seen on this
+	// connection. Narrowed by the boundary search.
+	bool sampled;
+	int requests, probes_left;
+	int64_t lo, hi;
+	time_sample ts;
+
+	// Samples of the burst taken so far, how many are still to come
+	// and whether the next one needs a new connection
+	std::vector<time_sample> burst;
+	int burst_left;
+	bool reconnect;
+
+	probe() : st(NULL), idx(0), fd(-1), state(PROBE_CONNECT), fail(FAIL_NONE), keep_alive(0), reused(0), reusable(0),
+	          deadline(0), t_send(0), t_recv(0), rt_send(0), stamped(0), sampled(0), requests(0),
+	          probes_left(0), lo(0), hi(0), burst_left(0), reconnect(0)
+	{
+#ifdef USE_SSL
+		tls = NULL;
+		ssl = NULL;
+		tls_stamp = 0;
+#endif
+	}
+
+	bool active() const
+	{
+		return state == PROBE_CONNECT || state == PROBE_HANDSHAKE || state == PROBE_WAIT || state == PROBE_READ;
+	}
+
+	bool has_sample() const
+	{
+		return sampled || !burst.empty();
+	}
+
+	void close_fd()
+	{
+#ifdef USE_SSL
+		if (ssl)
+			SSL_free(ssl);
+		ssl = NULL;
+#endif
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+};
+
+
+// deadline, slot
+typedef pair<int64_t, size_t> timer;
+
 }
 
 
 // automatically close() all files when leaving scope
-class auto_fd_map : public map<int, string> {
+class auto_probes : public vector<probe> {
 
 public:
-	auto_fd_map()
+	auto_probes()
 	{
 	}
 
-	virtual ~auto_fd_map()
+	virtual ~auto_probes()
 	{
-		for (map<int, string>::iterator i = this->begin(); i != this->end(); ++i)
-			close(i->first);
+		for (vector<probe>::iterator i = this->begin(); i != this->end(); ++i)
+			i->close_fd();
 	}
 };
 
@@ -81,209 +208,1265 @@ http_date::~http_date()
 }
 
 
-int http_date::time_servers(const map<string, string> &ms)
+// Add getaddrinfo() results to the table, IPv6 and IPv4
+// interleaved as in RFC 8305 so that a broken family never delays all
+// attempts for a host.
+static void add_servers(server_table &st, uint32_t host, const vector<struct addrinfo *> &ais)
+{
+	vector<const struct addrinfo *> v4, v6;
+	bool dup = 0;
+
+	for (vector<struct addrinfo *>::const_iterator i = ais.begin(); i != ais.end(); ++i) {
+		for (const struct addrinfo *a = *i; a != NULL; a = a->ai_next) {
+			if (a->ai_family == AF_INET6)
+				v6.push_back(a);
+			else if (a->ai_family == AF_INET)
+				v4.push_back(a);
+		}
+	}
+	for (size_t j = 0; j < v4.size() || j < v6.size(); ++j) {
+		if (j < v6.size())
+			st.add(v6[j]->ai_addr, v6[j]->ai_addrlen, host, dup);
+		if (j < v4.size())
+			st.add(v4[j]->ai_addr, v4[j]->ai_addrlen, host, dup);
+	}
+}
+
+
+// HTTPS servers need the TLS context
+int http_date::tls_init(const server_config &c)
+{
+	if (!c.https)
+		return 0;
+#ifdef USE_SSL
+	if (tls.init() < 0) {
+		err<<"http_date::tls_init::"<<tls.why();
+		return -1;
+	}
+	return 0;
+#else
+	err<<"http_date::tls_init("<<c.name<<"): HTTPS needs a build with USE_SSL";
+	return -1;
+#endif
+}
+
+
+// Resolve all names. Every address of a name becomes a server of its own.
+// Also sets up the resolver for refreshing the names once in the chroot.
+int http_date::time_servers(const vector<server_config> &vc)
 {
 	struct addrinfo *ai = NULL, hints;
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_socktype = SOCK_STREAM;
 
+	// without nameservers, we just keep the addresses from startup
+	resolver.init("/etc/resolv.conf");
+
 	int e = 0;
-	for (map<string, string>::const_iterator i = ms.begin(); i != ms.end(); ++i) {
-		if ((e = getaddrinfo(i->first.c_str(), i->second.c_str(), &hints, &ai)) < 0) {
-			err<<"http_date::time_servers::getaddrinfo:"<<gai_strerror(e);
+	char addr[NI_MAXHOST];
+	for (vector<server_config>::const_iterator i = vc.begin(); i != vc.end(); ++i) {
+		if (tls_init(*i) < 0)
+			return -1;
+
+		hints.ai_family = i->opt.family;
+		if ((e = getaddrinfo(i->name.c_str(), i->port.c_str(), &hints, &ai)) != 0) {
+			err<<"http_date::time_servers::getaddrinfo("<<i->name<<"):"<<gai_strerror(e);
 			return -1;
 		}
-		servers[*ai] = i->first;
-		// do not call freeaddrinfo() as this was not a deep copy
+
+		add_servers(servers, servers.add_name(i->name, i->port, i->https, i->opt), vector<struct addrinfo *>(1, ai));
+
+		// no TTL known yet, so ask the nameserver at the first refresh
+		vector<string> addrs;
+		for (struct addrinfo *a = ai; a != NULL; a = a->ai_next) {
+			if (getnameinfo(a->ai_addr, a->ai_addrlen, addr, sizeof(addr), NULL, 0, NI_NUMERICHOST) == 0)
+				addrs.push_back(addr);
+		}
+		resolver.seed(i->name, addrs, 0);
+		freeaddrinfo(ai);
 	}
 
+	sched.reset(servers);
 	return 0;
 }
 
 
-time_t http_date::average_time(const vector<time_t> &vt)
+int http_date::export_metrics(const string &path)
 {
-	if (vt.size() == 0)
+	err.str("");
+	stats.frequency = clk.frequency();
+	if (stats.write(path, servers) < 0) {
+		err<<"http_date::export_metrics::"<<stats.why();
+		return -1;
+	}
+	return 0;
+}
+
+
+// Re-resolve names whose TTL expired, waiting at most msec for answers,
+// and swap in changed address sets. Kept-alive connections and the state
+// of addresses that are still in use survive.
+int http_date::refresh(int msec)
+{
+	if (!resolver.enabled())
 		return 0;
 
-	time_t min = vt[0];
-	vector<time_t>::const_iterator i;
+	struct addrinfo *ai = NULL, hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
 
-	if (vt.size() <= 2)
-		return min;
+	vector<string> due;
+	for (size_t i = 0; i < servers.names.size(); ++i) {
+		// IP literals never change
+		if (getaddrinfo(servers.names[i].c_str(), servers.ports[i].c_str(), &hints, &ai) == 0) {
+			freeaddrinfo(ai);
+			continue;
+		}
+		if (resolver.expired(servers.names[i]))
+			due.push_back(servers.names[i]);
+	}
 
-	// my own tricky algorithm to average all times and kill
-	// high and low breakouts without overflowing the time_t
-	for (i = vt.begin(); i != vt.end(); ++i) {
-		if (min < *i)
-			min = *i;
+	if (due.empty())
+		return 0;
+	if (resolver.resolve(due, msec) < 0) {
+		err<<"http_date::refresh::"<<resolver.why();
+		return -1;
 	}
 
-	// The average diff
-	time_t adiff = 0;
-	for (i = vt.begin(); i != vt.end(); ++i) {
-		adiff += (*i - min);
+	server_table fresh;
+	bool dup = 0;
+	int changed = 0;
+	size_t row = 0;
+	for (size_t i = 0; i < servers.names.size(); ++i) {
+		uint32_t h = fresh.add_name(servers.names[i], servers.ports[i], servers.tls[i], servers.options[i]);
+		vector<string> addrs;
+		vector<struct addrinfo *> ais;
+
+		// answers of the other family fail to convert
+		hints.ai_family = servers.options[i].family;
+
+		// Rows are shared between names resolving to the same address,
+		// so compare against the whole table, not just our own rows.
+		bool same = 1;
+		if (resolver.lookup(servers.names[i], addrs) == 0 && !addrs.empty()) {
+			for (vector<string>::iterator j = addrs.begin(); j != addrs.end(); ++j) {
+				if (getaddrinfo(j->c_str(), servers.ports[i].c_str(), &hints, &ai) != 0)
+					continue;
+				ais.push_back(ai);
+				if (!servers.find(ai->ai_addr, ai->ai_addrlen, row))
+					same = 0;
+			}
+			for (size_t j = 0; same && j < servers.size(); ++j) {
+				if (servers.host[j] == i)
+					same = find(addrs.begin(), addrs.end(), servers.address(j)) != addrs.end();
+			}
+		}
+
+		if (same) {
+			for (size_t j = 0; j < servers.size(); ++j) {
+				if (servers.host[j] == i)
+					fresh.add((struct sockaddr *)&servers.addr[j], servers.addr_len[j], h, dup);
+			}
+		} else {
+			++changed;
+			ostringstream os;
+			os<<servers.names[i]<<" now resolves to";
+			for (vector<string>::iterator j = addrs.begin(); j != addrs.end(); ++j)
+				os<<" "<<*j;
+			Log::log(Log::HTTPDATE_NOTICE, "%s", os.str().c_str());
+		}
+
+		// also picks up addresses whose row belonged to another name
+		add_servers(fresh, h, ais);
+		for (vector<struct addrinfo *>::iterator j = ais.begin(); j != ais.end(); ++j)
+			freeaddrinfo(*j);
+	}
+
+	if (changed == 0)
+		return 0;
+
+	// carry over connections and state of addresses still in use
+	for (size_t i = 0; i < fresh.size(); ++i) {
+		if (!servers.find((struct sockaddr *)&fresh.addr[i], fresh.addr_len[i], row))
+			continue;
+		fresh.take(i, servers, row);
+	}
+
+	// the old table closes whatever is left
+	servers.swap(fresh);
+	sched.reset(servers);
+	return changed;
+}
+
+
+static bool same_options(const server_options &a, const server_options &b)
+{
+	return a.family == b.family && a.weight == b.weight && a.minpoll == b.minpoll && a.maxpoll == b.maxpoll &&
+	       a.burst == b.burst && a.trusted == b.trusted && a.noselect == b.noselect;
+}
+
+
+static string name_key(const string &name, const string &port, bool https, int family)
+{
+	ostringstream os;
+	os<<name<<'\0'<<port<<'\0'<<https<<family;
+	return os.str();
+}
+
+
+// Switch to a new set of names, as read again from the config on SIGHUP,
+// so inside the chroot. Names that stay keep their addresses, connections
+// and statistics, and take the new options. New ones are resolved by our
+// own resolver, unless they are addresses. The rows of names that are
+// gone are closed, as are those of names whose address family changed.
+// Returns the number of names added, removed or changed.
+int http_date::reload(const vector<server_config> &vc, int msec)
+{
+	struct addrinfo *ai = NULL, hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
+
+	map<string, uint32_t> known;
+	for (size_t i = 0; i < servers.names.size(); ++i)
+		known[name_key(servers.names[i], servers.ports[i], servers.tls[i], servers.options[i].family)] = i;
+
+	vector<string> due;
+	vector<int> old;
+	int added = 0, removed = 0, changed = 0;
+	for (vector<server_config>::const_iterator i = vc.begin(); i != vc.end(); ++i) {
+		if (tls_init(*i) < 0)
+			return -1;
+
+		map<string, uint32_t>::iterator k = known.find(name_key(i->name, i->port, i->https, i->opt.family));
+		if (k != known.end()) {
+			old.push_back(k->second);
+			changed += !same_options(servers.options[k->second], i->opt);
+			continue;
+		}
+		old.push_back(-1);
+		++added;
+		if (getaddrinfo(i->name.c_str(), i->port.c_str(), &hints, &ai) == 0)
+			freeaddrinfo(ai);
+		else if (resolver.enabled())
+			due.push_back(i->name);
+		else
+			Log::log(Log::HTTPDATE_WARNING, "http_date::reload: no nameservers to resolve %s", i->name.c_str());
 	}
-	adiff /= vt.size();
+	removed = servers.names.size() - (vc.size() - added);
 
-	// recalculate min and diff without breakouts
-	int n = 0;
-	time_t diff = 0, average = min + adiff;
-	min = average;
-	for (i = vt.begin(); i != vt.end(); ++i) {
-		if (abs((double)(average - *i)) <= 2*adiff && *i < min)
-			min = *i;
+	if (added + removed + changed == 0)
+		return 0;
+
+	// the same names, just other options
+	if (added + removed == 0) {
+		for (size_t i = 0; i < vc.size(); ++i)
+			servers.options[old[i]] = vc[i].opt;
+		sched.reset(servers);
+		Log::log(Log::HTTPDATE_NOTICE, "http_date::reload: options of %d names changed", changed);
+		return changed;
 	}
 
-	for (i = vt.begin(); i != vt.end(); ++i) {
-		if (abs((double)(average - *i)) <= 2*adiff) {
-			diff += (*i - min);
-			++n;
+	if (!due.empty() && resolver.resolve(due, msec) < 0)
+		Log::log(Log::HTTPDATE_WARNING, "http_date::reload::%s", resolver.why());
+
+	vector<vector<size_t> > rows_of(servers.names.size());
+	for (size_t j = 0; j < servers.size(); ++j)
+		rows_of[servers.host[j]].push_back(j);
+
+	server_table fresh;
+	bool dup = 0;
+	size_t row = 0;
+	for (size_t i = 0; i < vc.size(); ++i) {
+		uint32_t h = fresh.add_name(vc[i].name, vc[i].port, vc[i].https, vc[i].opt);
+		vector<struct addrinfo *> ais;
+
+		hints.ai_family = vc[i].opt.family;
+		if (old[i] >= 0) {
+			const vector<size_t> &rows = rows_of[old[i]];
+			for (vector<size_t>::const_iterator j = rows.begin(); j != rows.end(); ++j)
+				fresh.add((struct sockaddr *)&servers.addr[*j], servers.addr_len[*j], h, dup);
+
+			// Rows are shared between names resolving to the same address, and
+			// the row of a removed name may carry ours, so add all cached ones.
+			vector<string> addrs;
+			resolver.lookup(vc[i].name, addrs);
+			for (vector<string>::iterator j = addrs.begin(); j != addrs.end(); ++j) {
+				if (getaddrinfo(j->c_str(), vc[i].port.c_str(), &hints, &ai) == 0)
+					ais.push_back(ai);
+			}
+		} else if (getaddrinfo(vc[i].name.c_str(), vc[i].port.c_str(), &hints, &ai) == 0)
+			ais.push_back(ai);
+		else {
+			// left without rows, the next refresh() tries again
+			vector<string> addrs;
+			resolver.lookup(vc[i].name, addrs);
+			for (vector<string>::iterator j = addrs.begin(); j != addrs.end(); ++j) {
+				if (getaddrinfo(j->c_str(), vc[i].port.c_str(), &hints, &ai) == 0)
+					ais.push_back(ai);
+			}
+			if (ais.empty())
+				Log::log(Log::HTTPDATE_WARNING, "http_date::reload: %s does not resolve", vc[i].name.c_str());
 		}
+
+		add_servers(fresh, h, ais);
+		for (vector<struct addrinfo *>::iterator j = ais.begin(); j != ais.end(); ++j)
+			freeaddrinfo(*j);
 	}
 
+	for (size_t i = 0; i < fresh.size(); ++i) {
+		if (servers.find((struct sockaddr *)&fresh.addr[i], fresh.addr_len[i], row))
+			fresh.take(i, servers, row);
+	}
 
-	if (n == 0)
+#ifdef USE_SSL
+	// pooled connections of the rows that are gone
+	for (size_t i = 0; i < servers.size(); ++i) {
+		if (servers.fd[i] >= 0)
+			tls.drop(servers.fd[i]);
+	}
+#endif
+
+	servers.swap(fresh);
+	sched.reset(servers);
+
+	Log::log(Log::HTTPDATE_NOTICE, "http_date::reload: %d names added, %d removed, %d changed, %zu servers",
+	         added, removed, changed, servers.size());
+	return added + removed + changed;
+}
+
+
+// Combine the samples into one offset, rejecting falsetickers. Without
+// a majority, the trusted samples decide among themselves; 1 is returned
+// then.
+int http_date::average_time(const vector<time_sample> &vs, Estimator::estimator_t est, Estimator::result &r)
+{
+	vector<Estimator::interval> vi;
+	vi.reserve(vs.size());
+
+	Estimator::interval iv;
+	for (vector<time_sample>::const_iterator i = vs.begin(); i != vs.end(); ++i) {
+		iv.offset = i->offset;
+		iv.error = i->error;
+		iv.weight = i->weight;
+		vi.push_back(iv);
+	}
+	if (Estimator::estimate(est, vi, r) == 0)
 		return 0;
 
-	diff /= n;
+	vi.clear();
+	for (vector<time_sample>::const_iterator i = vs.begin(); i != vs.end(); ++i) {
+		if (!i->trusted)
+			continue;
+		iv.offset = i->offset;
+		iv.error = i->error;
+		iv.weight = i->weight;
+		vi.push_back(iv);
+	}
+	if (vi.size() == vs.size() || Estimator::estimate(est, vi, r) < 0)
+		return -1;
+	return 1;
+}
 
-	return min + diff;
+
+static const char *label(const probe &pr)
+{
+	return pr.st->label(pr.idx).c_str();
 }
 
 
-int http_date::loop(int seconds)
+// CLOCK_MONOTONIC usec of a kernel receive stamp. Anything that does
+// not fit between sending the request and now, e.g. because the clock
+// was stepped meanwhile or there was no stamp, falls back to now.
+static int64_t arrival(const probe &pr, int64_t stamp, bool &kernel)
 {
-	auto_fd_map sfds;
-	vector<time_t> vt;
-	struct addrinfo ai;
-	int pe = 0; socklen_t pe_len = sizeof(pe);
-	char buf[1024];
-	int sfd;
-	time_t tp = 0;
-#ifdef TCP_INFO
-	uint64_t avg_rtt = 0, nrtt = 0;
-#else
-	uint64_t avg_rtt = 500000, nrtt = 1;
-#endif
+	int64_t now = mono_usec();
 
-	//  No log I/O before we calculate/set the time to have a minimum of accuracy
-	vector<string> log_strings;
-	log_strings.reserve(64);
+	kernel = 0;
+	if (stamp <= 0)
+		return now;
+	int64_t late = real_usec() - stamp;
+	if (late < 0 || now - late < pr.t_send)
+		return now;
+	kernel = 1;
+	return now - late;
+}
 
 
-	for (map<struct addrinfo, string>::iterator i = servers.begin();
-	     i != servers.end(); ++i) {
-		ai = i->first;
-		if ((sfd = socket(ai.ai_family, ai.ai_socktype, ai.ai_protocol)) < 0) {
-			err<<"http_date::loop::socket:"<<strerror(errno);
+// read()/write() through TLS if the server speaks it, with the same
+// errno conventions. A read also returns when its data arrived.
+static ssize_t probe_read(probe &pr, char *buf, size_t n, int64_t &stamp)
+{
+#ifdef USE_SSL
+	if (pr.ssl) {
+		// SSL_read() hides the segments, so the stamp comes from the
+		// BIO, of the recvmsg() that completed the record
+		stamp = 0;
+		int r = pr.tls->read(pr.ssl, buf, n > INT_MAX ? INT_MAX : (int)n, pr.tls_stamp);
+		if (r > 0) {
+			stamp = pr.tls_stamp;
+			return r;
+		}
+		switch (SSL_get_error(pr.ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0)
+				return 0;
+			return -1;
+		default:
+			errno = EPROTO;
 			return -1;
 		}
-		if (nonblock(sfd) < 0) {
-			err<<"http_date::loop::nonblock:"<<strerror(errno);
+	}
+#endif
+	return recv_stamped(pr.fd, buf, n, 0, stamp);
+}
+
+
+static int probe_write(probe &pr, const string &req)
+{
+#ifdef USE_SSL
+	// A fresh connection has room for a request, so anything short of
+	// writing it at once is an error.
+	if (pr.ssl) {
+		if (SSL_write(pr.ssl, req.c_str(), req.size()) != (int)req.size()) {
+			errno = EPROTO;
 			return -1;
 		}
-		if (connect(sfd, (struct sockaddr *)ai.ai_addr, ai.ai_addrlen) < 0 &&
-		    errno != EINPROGRESS) {
-			close(sfd);
-			err<<"http_date::loop::connect("<<i->second<<"):"<<strerror(errno);
-			log_strings.push_back(err.str());
-			continue;
+		return req.size();
+	}
+#endif
+	return writen(pr.fd, req.c_str(), req.size());
+}
+
+
+static int probe_send(probe &pr, poller &p, int msec);
+
+
+#ifdef USE_SSL
+
+// Drive the TLS handshake; the request follows right after it, so the
+// handshake never counts towards the delay.
+static int probe_handshake(probe &pr, poller &p, int msec)
+{
+	if (!pr.ssl && (pr.ssl = pr.tls->open(pr.fd, pr.st->names[pr.st->host[pr.idx]])) == NULL) {
+		Log::log(Log::HTTPDATE_WARNING, "http_date::loop::tls(%s): cannot create SSL", label(pr));
+		pr.fail = FAIL_CONNECT;
+		return PROBE_FAILED;
+	}
+
+	ERR_clear_error();
+	int r = SSL_do_handshake(pr.ssl);
+	if (r == 1) {
+		Log::log(Log::HTTPDATE_DEBUG, "http_date::loop::tls(%s): %s %s%s", label(pr), SSL_get_version(pr.ssl),
+		         SSL_get_cipher_name(pr.ssl), SSL_session_reused(pr.ssl) ? " resumed" : "");
+		return probe_send(pr, p, msec);
+	}
+
+	int e = SSL_get_error(pr.ssl, r), what = 0;
+	if (e == SSL_ERROR_WANT_READ)
+		what = poller::POLL_IN;
+	else if (e == SSL_ERROR_WANT_WRITE)
+		what = poller::POLL_OUT;
+	if (what == 0 || p.mod(pr.fd, what) < 0) {
+		unsigned long le = ERR_get_error();
+		Log::log(Log::HTTPDATE_WARNING, "http_date::loop::tls(%s):%s", label(pr),
+		         le ? ERR_error_string(le, NULL) : e == SSL_ERROR_SYSCALL ? strerror(errno) : "handshake failed");
+		pr.fail = FAIL_CONNECT;
+		return PROBE_FAILED;
+	}
+	return PROBE_HANDSHAKE;
+}
+
+#endif
+
+
+static int probe_send(probe &pr, poller &p, int msec)
+{
+	string req = "HEAD / HTTP/1.0\r\n\r\n";
+
+	// the boundary search and the pool need to reuse the connection
+	if (pr.keep_alive)
+		req = "HEAD / HTTP/1.1\r\nHost: " + pr.st->names[pr.st->host[pr.idx]] + "\r\n\r\n";
+
+	pr.hp.reset();
+	pr.reusable = 0;
+	pr.t_recv = 0;
+	pr.rt_send = real_usec();
+	pr.t_send = mono_usec();
+	if (probe_write(pr, req) <= 0) {
+		Log::log(Log::HTTPDATE_WARNING, "http_date::loop::write(%s):%s", label(pr), strerror(errno));
+		pr.fail = FAIL_READ;
+		return PROBE_FAILED;
+	}
+	if (p.mod(pr.fd, poller::POLL_IN) < 0) {
+		Log::log(Log::HTTPDATE_WARNING, "%s", p.why());
+		pr.fail = FAIL_READ;
+		return PROBE_FAILED;
+	}
+	++pr.requests;
+	pr.deadline = mono_usec() + (int64_t)msec*1000;
+	return PROBE_READ;
+}
+
+
+// Drive the connect -> request -> response state machine of one server,
+// on the poller events in what. Returns the new state.
+static int probe_step(probe &pr, poller &p, int what, int msec)
+{
+	int pe = 0; socklen_t pe_len = sizeof(pe);
+	char *buf = NULL;
+	size_t n = 0;
+	ssize_t r = 0;
+	int64_t now = 0, stamp = 0;
+	bool dated = 0, kernel = 0;
+
+	if (pr.state == PROBE_CONNECT) {
+		// a connect that failed also signals an error, so most skip the syscall
+		if ((what & poller::POLL_ERR) && getsockopt(pr.fd, SOL_SOCKET, SO_ERROR, &pe, &pe_len) < 0)
+			pe = errno;
+		if (pe != 0) {
+			Log::log(Log::HTTPDATE_WARNING, "http_date::loop::connect(%s):%s", label(pr), strerror(pe));
+			pr.fail = FAIL_CONNECT;
+			return PROBE_FAILED;
+		}
+#ifdef USE_SSL
+		if (pr.tls && !pr.ssl)
+			return probe_handshake(pr, p, msec);
+#endif
+		return probe_send(pr, p, msec);
+	}
+
+#ifdef USE_SSL
+	if (pr.state == PROBE_HANDSHAKE)
+		return probe_handshake(pr, p, msec);
+#endif
+
+	// PROBE_READ: parse in place up to the end of the header
+	for (;;) {
+		buf = pr.hp.space(n);
+		if ((r = probe_read(pr, buf, n, stamp)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return PROBE_READ;
+			if (errno == EINTR)
+				continue;
+			Log::log(Log::HTTPDATE_WARNING, "http_date::loop::read(%s):%s", label(pr), strerror(errno));
+			pr.fail = FAIL_READ;
+			return PROBE_FAILED;
+		}
+		if (r == 0) {
+			if (pr.t_recv == 0) {
+				Log::log(Log::HTTPDATE_WARNING, "http_date::loop::read(%s): connection closed", label(pr));
+				pr.fail = FAIL_READ;
+				return PROBE_FAILED;
+			}
+			pr.hp.eof();
+			break;
+		}
+		now = arrival(pr, stamp, kernel);
+		if (pr.t_recv == 0)
+			pr.t_recv = now;
+		dated = pr.hp.date != NULL;
+		int hs = pr.hp.feed(r, now);
+		if (!dated && pr.hp.date != NULL)
+			pr.stamped = kernel;
+		if (hs != header_parser::HP_MORE)
+			break;
+	}
+
+	// a broken header still counts if the Date line made it
+	if (pr.hp.state() == header_parser::HP_ERROR && pr.hp.date == NULL) {
+		Log::log(Log::HTTPDATE_WARNING, "http_date::loop::read(%s): malformed response header", label(pr));
+		pr.fail = FAIL_PARSE;
+		return PROBE_FAILED;
+	}
+	return PROBE_DONE;
+}
+
+
+// A complete response arrived. Narrow the offset interval by its Date and,
+// if the boundary search is still going, schedule the next request so that
+// it hits the server when its Date is expected to tick over to the next
+// second. Whether it did or not halves the interval.
+static int probe_answer(probe &pr, poller &p)
+{
+	time_t d = 0;
+	int64_t lo = 0, hi = 0, server = 0;
+
+	// T4 is when the segment carrying the Date line arrived, which
+	// need not be the first one of the response.
+	int64_t recv = pr.hp.date_recv, t1 = pr.rt_send, delay = recv - pr.t_send, t4 = t1 + delay;
+
+	pr.reusable = pr.hp.keep_alive();
+	if (pr.hp.hires) {
+		// An unsynchronized httpdated has nothing to offer
+		if (pr.hp.stratum >= 16)
+			return pr.has_sample() ? PROBE_DONE : PROBE_FAILED;
+
+		// Another httpdated told us T2 and T3, so this is plain NTP.
+		// T4 may have to fall back to the end of the header.
+		if (pr.hp.date == NULL) {
+			recv = mono_usec();
+			t4 = t1 + (recv - pr.t_send);
+		}
+		int64_t t2 = pr.hp.rx, t3 = pr.hp.tx;
+		int64_t offset = ((t2 - t1) + (t3 - t4))/2;
+		delay = (t4 - t1) - (t3 - t2);
+		if (delay < 0)
+			delay = 0;
+		lo = offset - delay/2 - pr.hp.error;
+		hi = offset + delay/2 + pr.hp.error;
+		server = t3;
+		pr.ts.stratum = pr.hp.stratum;
+	} else {
+		if (parse_http_date(pr.hp.date, pr.hp.date_len, d) < 0) {
+			pr.fail = FAIL_PARSE;
+			return pr.has_sample() ? PROBE_DONE : PROBE_FAILED;
+		}
+
+		// The server read its clock somewhere between T1 and T4, and its
+		// clock was then somewhere within [Date, Date + 1s).
+		int64_t date = (int64_t)d*1000000;
+		lo = date - t4;
+		hi = date + 1000000 - t1;
+
+		// Date is truncated to the second, so on average the server
+		// clock was half a second ahead of it
+		server = date + 500000;
+		pr.ts.stratum = 1;
+	}
+
+	if (!pr.sampled) {
+		pr.sampled = 1;
+		pr.lo = lo;
+		pr.hi = hi;
+		pr.ts.idx = pr.idx;
+		pr.ts.rt_send = pr.rt_send;
+		pr.ts.mono_send = pr.t_send;
+		pr.ts.mono_recv = recv;
+		pr.ts.stamped = pr.stamped && pr.hp.date != NULL;
+		pr.ts.delay = delay;
+	} else {
+		// A Date contradicting the previous ones means the server clock
+		// or its path jitters more than we can resolve; keep what we have.
+		if (lo > pr.hi || hi < pr.lo) {
+			pr.probes_left = 0;
+			return PROBE_DONE;
 		}
-		sfds[sfd] = i->second;
+		pr.lo = max(pr.lo, lo);
+		pr.hi = min(pr.hi, hi);
+		if (delay < pr.ts.delay)
+			pr.ts.delay = delay;
 	}
 
-	sleep(seconds);
+	pr.ts.server = server;
+	pr.ts.offset = pr.lo + (pr.hi - pr.lo)/2;
+	pr.ts.error = (pr.hi - pr.lo)/2;
+
+	// the boundary search only helps with whole seconds
+	if (pr.probes_left <= 0 || pr.hi - pr.lo <= pr.ts.delay || !pr.reusable || pr.hp.hires)
+		return PROBE_DONE;
+	--pr.probes_left;
+
+	// Aim the midpoint of the next request at the instant the servers
+	// clock reaches a full second if the offset were in the middle of
+	// the interval: now_server = local + offset
+	int64_t mid = pr.lo + (pr.hi - pr.lo)/2, now_rt = real_usec(), now = mono_usec();
+	int64_t boundary = ((now_rt + mid + pr.ts.delay/2 + 10000)/1000000 + 1)*1000000;
+	int64_t send_rt = boundary - mid - pr.ts.delay/2;
+
+	if (p.mod(pr.fd, 0) < 0)
+		return PROBE_DONE;
+	pr.deadline = now + (send_rt - now_rt);
+	return PROBE_WAIT;
+}
 
-	for (auto_fd_map::iterator i = sfds.begin(); i != sfds.end(); ++i) {
-		pe = 0;
-		if (getsockopt(i->first, SOL_SOCKET, SO_ERROR, &pe, &pe_len) < 0) {
-			err<<"http_date::loop::loop::getsockopt:"<<strerror(errno);
+
+// The sample is complete, but more of the burst are to come. Bank it and
+// send the next request one round trip later, so that it does not queue
+// up right behind the last one. A server that closed the connection
+// gets a new one.
+static int probe_burst(probe &pr, poller &p, int boundary)
+{
+	pr.burst.push_back(pr.ts);
+	pr.sampled = 0;
+	pr.probes_left = boundary;
+	--pr.burst_left;
+
+	if (!pr.reusable) {
+		pr.reconnect = 1;
+		return PROBE_DONE;
+	}
+	if (p.mod(pr.fd, 0) < 0)
+		return PROBE_DONE;
+	pr.deadline = mono_usec() + pr.ts.delay;
+	return PROBE_WAIT;
+}
+
+
+// A pooled connection is only usable if the server did not close it
+// meanwhile and nothing unexpected is pending on it.
+static bool conn_alive(int fd)
+{
+	char c = 0;
+	ssize_t r = recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+	return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+// Start a probe on server idx, reusing fd if it is valid. Returns 0,
+// -1 if the server is unreachable right now or -2 if we ran out of
+// resources (err is set).
+static int probe_open(const server_table &st, size_t idx, int fd, probe &pr,
+                      poller &p, string &err)
+{
+	bool reused = fd >= 0;
+
+	if (!reused) {
+		int one = 1;
+#ifdef SOCK_NONBLOCK
+		// saves the fcntl() pair of nonblock(), which adds up over thousands of servers
+		if ((fd = socket(st.addr[idx].ss_family, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0) {
+#else
+		if ((fd = socket(st.addr[idx].ss_family, SOCK_STREAM, 0)) < 0) {
+#endif
+			err = "http_date::loop::socket:";
+			err += strerror(errno);
+			return -2;
+		}
+#ifdef SOCK_NONBLOCK
+		// the rest of what nonblock() does
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+			close(fd);
+			err = "http_date::loop::setsockopt:";
+			err += strerror(errno);
+			return -2;
+		}
+#else
+		if (nonblock(fd) < 0) {
+			close(fd);
+			err = "http_date::loop::nonblock:";
+			err += strerror(errno);
+			return -2;
+		}
+#endif
+#ifdef PROBE_TIMESTAMP
+		// without, reads are stamped when we get to them
+		setsockopt(fd, SOL_SOCKET, PROBE_TIMESTAMP, &one, sizeof(one));
+#endif
+		if (connect(fd, (struct sockaddr *)&st.addr[idx], st.addr_len[idx]) < 0 && errno != EINPROGRESS) {
+			Log::log(Log::HTTPDATE_WARNING, "http_date::loop::connect(%s):%s", st.label(idx).c_str(), strerror(errno));
+			close(fd);
 			return -1;
 		}
-		if (pe != 0) {
-			err<<"http_date::loop::connect("<<i->second<<"):"<<strerror(errno);
-			log_strings.push_back(err.str());
-			continue;
+	}
+
+	// A pooled connection is writable right away and so skips connect
+	if (p.add(fd, poller::POLL_OUT) < 0) {
+		close(fd);
+		err = "http_date::loop::";
+		err += p.why();
+		return -2;
+	}
+
+	pr = probe();
+	pr.st = &st;
+	pr.idx = idx;
+	pr.fd = fd;
+	pr.reused = reused;
+	return 0;
+}
+
+
+// How many servers can be probed at once without running out of
+// file descriptors, leaving room for pooled connections and the rest.
+size_t http_date::batch_size()
+{
+	struct rlimit rl;
+	size_t n = 1024, reserve = 32;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		n = rl.rlim_cur;
+
+	for (size_t i = 0; i < servers.size(); ++i) {
+		if (servers.fd[i] >= 0)
+			++reserve;
+	}
+
+	return n > reserve + 16 ? n - reserve : 16;
+}
+
+
+// Probe the servers rows[first, last) concurrently and add their samples to vs
+int http_date::probe_batch(const vector<size_t> &rows, size_t first, size_t last, int msec,
+                           vector<time_sample> &vs)
+{
+	auto_probes pv;
+	poller p;
+	vector<poller::event> ev;
+	vector<ssize_t> slot_of;
+	priority_queue<timer, vector<timer>, greater<timer> > timers;
+	int64_t now = 0, deadline = 0;
+	size_t active = 0;
+	string oerr = "";
+	int fd = -1;
+
+	if (p.init() < 0) {
+		err<<"http_date::loop::"<<p.why();
+		return -1;
+	}
+
+	pv.reserve(last - first);
+	now = mono_usec();
+	for (size_t k = first; k < last; ++k) {
+		size_t i = rows[k];
+		bool https = servers.tls[servers.host[i]];
+		servers.reach[i] <<= 1;
+		++servers.stats[i].polls;
+
+#ifdef USE_SSL
+		SSL *ssl = NULL;
+#endif
+		if ((fd = servers.fd[i]) >= 0) {
+			servers.fd[i] = -1;
+#ifdef USE_SSL
+			// a plain fd may carry the number of a closed TLS one
+			if (https)
+				ssl = tls.take(fd);
+			else
+				tls.drop(fd);
+			if (https && !ssl) {
+				close(fd);
+				fd = -1;
+			}
+#endif
+			if (fd >= 0 && (now - servers.last_used[i] > (int64_t)idle_limit*1000000 || !conn_alive(fd))) {
+#ifdef USE_SSL
+				if (ssl)
+					SSL_free(ssl);
+				ssl = NULL;
+#endif
+				close(fd);
+				fd = -1;
+			}
 		}
-		if (writen(i->first, "HEAD / HTTP/1.0\r\n\r\n", 19) <= 0) {
-			err<<"http_date::loop::loop::write("<<i->second<<"):"<<strerror(errno);
-			log_strings.push_back(err.str());
+
+		pv.push_back(probe());
+		probe &pr = pv.back();
+		int r = probe_open(servers, i, fd, pr, p, oerr);
+		if (r == -2) {
+#ifdef USE_SSL
+			if (ssl)
+				SSL_free(ssl);
+#endif
+			err<<oerr;
+			return -1;
+		} else if (r < 0) {
+			++servers.stats[i].connect_errors;
+			pv.pop_back();
 			continue;
 		}
+#ifdef USE_SSL
+		if (https) {
+			pr.tls = &tls;
+			pr.ssl = ssl;
+		}
+#else
+		(void)https;
+#endif
+		int burst = servers.opt(i).burst > 0 ? servers.opt(i).burst : burst_samples;
+		pr.keep_alive = idle_limit > 0 || boundary_probes > 0 || burst > 1;
+		pr.probes_left = boundary_probes;
+		pr.burst_left = burst - 1;
+		pr.deadline = now + (int64_t)msec*1000;
+
+		if ((size_t)pr.fd >= slot_of.size())
+			slot_of.resize(pr.fd + 1, -1);
+		slot_of[pr.fd] = pv.size() - 1;
+		timers.push(timer(pr.deadline, pv.size() - 1));
+		++active;
 	}
 
-	sleep(seconds);
+	// Handle each server the moment its socket becomes ready, rather than
+	// waiting for fixed delay slots. Each phase has its own deadline.
+	while (active > 0) {
+		now = mono_usec();
+		while (!timers.empty() && timers.top().first <= now) {
+			timer t = timers.top();
+			timers.pop();
+			probe &pr = pv[t.second];
 
-	string header = "", date = "";
-	struct tm tm;
-	for (auto_fd_map::iterator i = sfds.begin(); i != sfds.end(); ++i) {
-		memset(buf, 0, sizeof(buf));
-		if (read(i->first, buf, sizeof(buf)) <= 0) {
-			err<<"http_date::loop::loop::read("<<i->second<<"):"<<strerror(errno);
-			log_strings.push_back(err.str());
-			continue;
+			// superseded by a later deadline
+			if (!pr.active() || pr.deadline != t.first)
+				continue;
+
+			if (pr.state == PROBE_WAIT) {
+				pr.state = probe_send(pr, p, msec);
+			} else {
+				Log::log(Log::HTTPDATE_WARNING, "http_date::loop::timeout(%s): no %s within %dms", label(pr),
+				         pr.state == PROBE_CONNECT ? "connect" : pr.state == PROBE_HANDSHAKE ? "handshake" : "response",
+				         msec);
+				pr.state = PROBE_FAILED;
+				pr.fail = FAIL_TIMEOUT;
+			}
+			if (pr.state == PROBE_FAILED) {
+				if (pr.has_sample())
+					pr.state = PROBE_DONE;
+				p.del(pr.fd);
+				--active;
+				continue;
+			}
+			timers.push(timer(pr.deadline, t.second));
 		}
+		if (active == 0)
+			break;
 
-		header = buf;
-		string::size_type d = string::npos, nl = string::npos;
-		if ((d = header.find("Date: ")) == string::npos)
-			continue;
-		if ((nl = header.find("\r\n", d)) == string::npos)
-			continue;
-		date = header.substr(d + 6, nl - (d + 6));
-		if (date.length() > 40)
+		int64_t next = timers.top().first;
+		if (p.wait(ev, next > now ? (int)((next - now + 999)/1000) : 0) < 0) {
+			err<<"http_date::loop::"<<p.why();
+			return -1;
+		}
+
+		for (vector<poller::event>::iterator e = ev.begin(); e != ev.end(); ++e) {
+			if ((size_t)e->fd >= slot_of.size() || slot_of[e->fd] < 0)
+				continue;
+			size_t slot = slot_of[e->fd];
+			probe &pr = pv[slot];
+			if (pr.state != PROBE_CONNECT && pr.state != PROBE_HANDSHAKE && pr.state != PROBE_READ) {
+				// peer closed while we waited for the next boundary
+				if (pr.state == PROBE_WAIT && (e->what & poller::POLL_ERR)) {
+					pr.state = PROBE_DONE;
+					pr.reusable = 0;
+					p.del(pr.fd);
+					--active;
+				}
+				continue;
+			}
+
+			deadline = pr.deadline;
+			pr.state = probe_step(pr, p, e->what, msec);
+			if (pr.state == PROBE_DONE)
+				pr.state = probe_answer(pr, p);
+			if (pr.state == PROBE_DONE && pr.burst_left > 0)
+				pr.state = probe_burst(pr, p, boundary_probes);
+			if (pr.state == PROBE_FAILED && pr.has_sample())
+				pr.state = PROBE_DONE;
+			if (pr.active()) {
+				if (pr.deadline != deadline)
+					timers.push(timer(pr.deadline, slot));
+				continue;
+			}
+
+			p.del(pr.fd);
+			--active;
+
+			// The server dropped a pooled connection; one fresh attempt.
+			// Or it closed after a sample and the burst goes on.
+			bool next = pr.state == PROBE_DONE && pr.reconnect;
+			if (!next && (pr.state != PROBE_FAILED || !pr.reused))
+				continue;
+			slot_of[pr.fd] = -1;
+#ifdef USE_SSL
+			if (pr.ssl && SSL_is_init_finished(pr.ssl))
+				tls.save(servers.names[servers.host[pr.idx]], pr.ssl);
+#endif
+			pr.close_fd();
+
+			size_t idx = pr.idx;
+			bool keep_alive = pr.keep_alive;
+			int requests = pr.requests, burst_left = pr.burst_left;
+			vector<time_sample> burst;
+			burst.swap(pr.burst);
+#ifdef USE_SSL
+			tls_client *tc = pr.tls;
+#endif
+			int r = probe_open(servers, idx, -1, pr, p, oerr);
+			if (r == -2) {
+				err<<oerr;
+				return -1;
+			}
+			pr.burst.swap(burst);
+			pr.burst_left = burst_left;
+			pr.requests = requests;
+			if (r < 0) {
+				pr.state = next ? PROBE_DONE : PROBE_FAILED;
+				pr.fail = FAIL_CONNECT;
+				continue;
+			}
+			pr.keep_alive = keep_alive;
+#ifdef USE_SSL
+			pr.tls = tc;
+#endif
+			pr.probes_left = boundary_probes;
+			pr.deadline = mono_usec() + (int64_t)msec*1000;
+			if ((size_t)pr.fd >= slot_of.size())
+				slot_of.resize(pr.fd + 1, -1);
+			slot_of[pr.fd] = slot;
+			timers.push(timer(pr.deadline, slot));
+			++active;
+		}
+	}
+
+	now = mono_usec();
+	for (auto_probes::iterator i = pv.begin(); i != pv.end(); ++i) {
+		probe &pr = *i;
+		server_stats &ss = servers.stats[pr.idx];
+#ifdef USE_SSL
+		if (pr.ssl && SSL_is_init_finished(pr.ssl))
+			tls.save(servers.names[servers.host[pr.idx]], pr.ssl);
+#endif
+		if (pr.state != PROBE_DONE) {
+			if (pr.fail == FAIL_CONNECT)
+				++ss.connect_errors;
+			else if (pr.fail == FAIL_TIMEOUT)
+				++ss.timeouts;
+			else if (pr.fail == FAIL_READ)
+				++ss.read_errors;
+			else if (pr.fail == FAIL_PARSE)
+				++ss.parse_errors;
 			continue;
+		}
 
 #ifdef USE_TCP_INFO
 		struct tcp_info ti;
 		socklen_t sl = sizeof(ti);
 		// Kick off hosts with huge RTT so they cant mess up time measurement.
-		if (getsockopt(i->first, SOL_TCP, TCP_INFO, &ti, &sl) == 0) {
+		if (getsockopt(pr.fd, SOL_TCP, TCP_INFO, &ti, &sl) == 0) {
 			if (ti.tcpi_total_retrans > 0 || ti.tcpi_rcv_rtt >= 5000000 ||
-			    ti.tcpi_rtt >= 10000000)
+			    ti.tcpi_rtt >= 10000000) {
+				++ss.dropped;
 				continue;
-			avg_rtt += ti.tcpi_rtt;
-			++nrtt;
+			}
 		}
 #endif
 
-		memset(&tm, 0, sizeof(tm));
-		strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S %Z", &tm);
-		date += " ";
-		date += i->second;
-		log_strings.push_back(date);
+		if (pr.sampled)
+			pr.burst.push_back(pr.ts);
 
-		tp = timegm(&tm);
+		// all of a burst go to the clock filter, the quickest is logged
+		size_t best = 0;
+		for (size_t j = 0; j < pr.burst.size(); ++j) {
+			vs.push_back(pr.burst[j]);
+			if (pr.burst[j].delay < pr.burst[best].delay)
+				best = j;
+		}
+		const time_sample &ts = pr.burst[best];
 
-		// nullify constant delay slot
-		tp += seconds;
+		time_t d = ts.server/1000000;
+		char date[64], burst[32] = "";
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&d));
+		if (pr.burst.size() > 1)
+			snprintf(burst, sizeof(burst), " best of %zu", pr.burst.size());
+		Log::log(Log::HTTPDATE_INFO, "%s %s offset=%+.6fs delay=%+.6fs error=%+.6fs stratum=%d requests=%d%s%s",
+		         date, label(pr), (double)ts.offset/1000000, (double)ts.delay/1000000,
+		         (double)ts.error/1000000, ts.stratum, pr.requests, burst, pr.reused ? " reused" : "");
 
-		vt.push_back(tp);
+		// idle keep-alive connections go back into the pool for the next round
+		if (idle_limit > 0 && pr.reusable) {
+			servers.fd[pr.idx] = pr.fd;
+			servers.last_used[pr.idx] = now;
+#ifdef USE_SSL
+			if (pr.ssl)
+				tls.pool(pr.fd, pr.ssl);
+			pr.ssl = NULL;
+#endif
+			pr.fd = -1;
+		}
 	}
 
+	return 0;
+}
 
-	if ((tp = average_time(vt)) == 0)
-		log_strings.push_back("Weird. Cannot compute an average time! All servers down ?!");
-	else
-		log_strings.push_back(ctime(&tp));
 
-	if (nrtt > 0)
-		avg_rtt /= nrtt;
-	else
-		avg_rtt = 500000;
+int http_date::loop(int msec)
+{
+	vector<time_sample> vs, all;
+	vector<size_t> rows;
 
-	int r = 0;
-	struct timeval tv;
-	tv.tv_sec = tp;
-	tv.tv_usec = avg_rtt;
-	if (!no_set_time && tp)
-		if ((r = settimeofday(&tv, NULL)) < 0)
-			err<<"http_date::loop::loop::settimeofday:"<<strerror(errno);
+	// servers due within the next half second go along
+	int64_t now = mono_usec();
+	sched.due(servers, now + 500000, rows);
+	if (rows.empty())
+		return 0;
 
-	for_each (log_strings.begin(), log_strings.end(), ptr_fun(&Log::log));
+	//  No log I/O before we calculate/set the time to have a minimum of accuracy
+	log_hold lh;
 
-	return r;
-}
+	// stay below RLIMIT_NOFILE, no matter how large the pool. Nothing is
+	// in flight between batches, so the log is written out there.
+	size_t bs = batch_size();
+	for (size_t first = 0; first < rows.size(); first += bs) {
+		if (first > 0)
+			Log::drain();
+		if (probe_batch(rows, first, min(first + bs, rows.size()), msec, vs) < 0)
+			return -1;
+	}
+	++stats.rounds;
+	stats.round_time.add(mono_usec() - now);
+
+	// All addresses of a host raced against each other. Those much slower
+	// than the hosts best one are likely routed badly; drop them.
+	vector<int64_t> best(servers.names.size(), -1);
+	for (vector<time_sample>::iterator i = vs.begin(); i != vs.end(); ++i) {
+		int64_t &b = best[servers.host[i->idx]];
+		if (b < 0 || i->delay < b)
+			b = i->delay;
+	}
+	for (vector<time_sample>::iterator i = vs.begin(); i != vs.end();) {
+		int64_t b = best[servers.host[i->idx]];
+		if (i->delay > 2*b + 10000) {
+			Log::log(Log::HTTPDATE_NOTICE, "dropping slow %s delay=%+.6fs best=%+.6fs", servers.label(i->idx).c_str(),
+			         (double)i->delay/1000000, (double)b/1000000);
+			++servers.stats[i->idx].dropped;
+			i = vs.erase(i);
+		} else
+			++i;
+	}
 
+	// Shift the new samples into the clock filters. Offsets taken before
+	// a correction of the clock are made relative to the current clock by
+	// what has been applied since.
+	now = mono_usec();
+	vector<char> got(servers.size(), 0);
+	for (vector<time_sample>::iterator i = vs.begin(); i != vs.end(); ++i) {
+		size_t row = i->idx;
+		got[row] = 1;
+		++servers.stats[row].samples;
+		servers.stats[row].rtt.add(i->delay);
+		servers.stats[row].offset.add(i->offset);
+		servers.stats[row].stamped += i->stamped;
+		servers.filter[row].add(i->offset, i->delay, i->error, i->stratum, i->mono_recv, applied);
+	}
 
+	// Each polled server is represented by the sample of least delay
+	// among its recent ones, and scheduled anew.
+	for (vector<size_t>::iterator i = rows.begin(); i != rows.end(); ++i) {
+		size_t row = *i;
+		if (!got[row]) {
+			sched.missed(servers, row, now);
+			continue;
+		}
+		const clock_filter &f = servers.filter[row];
+		int64_t jitter = 0;
+		int s = f.select(now, applied, jitter);
+		sched.sampled(servers, row, f.offset[s] - (applied - f.applied[s]), jitter, f.error[s]);
+		servers.reach[row] |= 1;
+		servers.offset[row] = f.offset[s];
+		servers.delay[row] = f.delay[s];
+		servers.error[row] = f.error[s];
+		servers.stratum[row] = f.stratum[s];
+		servers.sampled[row] = f.when[s];
+		servers.applied[row] = f.applied[s];
+	}
+
+	// Combine with the samples of all other servers that are still fresh,
+	// i.e. answered within twice their poll interval. The selected sample
+	// may be older than that; its error grows by 15ppm of its age, as in
+	// NTP. noselect servers are left out.
+	bool fresh = 0;
+	for (vector<time_sample>::iterator i = vs.begin(); i != vs.end(); ++i)
+		fresh |= !servers.opt(i->idx).noselect;
+	for (size_t i = 0; i < servers.size(); ++i) {
+		int64_t age = now - servers.sampled[i], heard = servers.filter[i].last();
+		if (heard == 0 || now - heard > (int64_t)servers.interval[i]*2000000 + msec*1000 || servers.opt(i).noselect)
+			continue;
+		time_sample ts;
+		memset(&ts, 0, sizeof(ts));
+		ts.idx = i;
+		ts.offset = servers.offset[i] - (applied - servers.applied[i]);
+		ts.delay = servers.delay[i];
+		ts.error = servers.error[i] + age*15/1000000;
+		ts.stratum = servers.stratum[i];
+		ts.weight = servers.opt(i).weight;
+		ts.trusted = servers.opt(i).trusted;
+		all.push_back(ts);
+	}
+	vs.swap(all);
+
+	// only failed servers were due, nothing new to go by
+	if (!fresh && !vs.empty())
+		return 0;
+
+	// the PLL follows the most frequent poll
+	clk.interval(sched.shortest(servers));
+
+	int r = 0, by = 0;
+	Estimator::result res;
+	bool hold = 0;
+	if (vs.empty()) {
+		Log::log(Log::HTTPDATE_WARNING, "Weird. Cannot compute an average time! All servers down ?!");
+		++stats.no_samples;
+		hold = 1;
+	} else if ((by = average_time(vs, est, res)) < 0) {
+		Log::log(Log::HTTPDATE_WARNING, "No majority among %zu samples, not touching the clock", vs.size());
+		++stats.no_majority;
+		hold = 1;
+	} else {
+		int64_t offset = res.offset;
+		int how = -1;
+
+		if (by > 0)
+			Log::log(Log::HTTPDATE_NOTICE, "No majority among %zu samples, going by the trusted ones", vs.size());
+
+		last.rt = real_usec();
+		last.mono = mono_usec();
+		last.offset = offset;
+		last.error = res.error;
+		last.used = res.used;
+		last.samples = vs.size();
+		last.delay = vs[0].delay;
+		last.stratum = vs[0].stratum;
+		for (vector<time_sample>::iterator i = vs.begin(); i != vs.end(); ++i) {
+			last.delay = min(last.delay, i->delay);
+			last.stratum = min(last.stratum, i->stratum);
+		}
+		++stats.estimates;
+		stats.estimated = 1;
+		stats.offset = offset;
+		stats.error = res.error;
+
+		if (!no_set_time) {
+			if ((how = clk.adjust(offset, res.error)) < 0) {
+				err<<"http_date::loop::"<<clk.why();
+				r = -1;
+			}
+		}
+
+		// While slewing, the offset is still to be worked off
+		if (how == clock_discipline::CLOCK_STEPPED)
+			++stats.steps;
+		else if (how == clock_discipline::CLOCK_SLEWED)
+			++stats.slews;
+		if (how >= 0) {
+			applied += offset;
+			synced = 1;
+			sync_mono = mono_usec();
+			sync_stratum = last.stratum;
+			sync_error = res.error + (how == clock_discipline::CLOCK_SLEWED ? (offset < 0 ? -offset : offset) : 0);
+		}
+
+		time_t tp = (real_usec() + (how == clock_discipline::CLOCK_STEPPED ? 0 : offset))/1000000;
+		char ct[64], freq[64] = "";
+		if (ctime_r(&tp, ct) == NULL)
+			ct[0] = 0;
+		ct[strcspn(ct, "\n")] = 0;
+		if (how >= 0 && clk.frequency_known())
+			snprintf(freq, sizeof(freq), ", frequency %.3fppm", clk.frequency());
+		Log::log(how >= 0 ? Log::HTTPDATE_NOTICE : Log::HTTPDATE_INFO,
+		         "%s offset %+.6fs +/- %.6fs from %zu of %zu samples (%s), %s%s",
+		         how == clock_discipline::CLOCK_STEPPED ? "stepped" : how == clock_discipline::CLOCK_SLEWED ? "slewing" : "measured",
+		         (double)offset/1000000, (double)res.error/1000000, res.used, vs.size(), Estimator::name(est), ct, freq);
+	}
+
+	// the kernel keeps running on the learned frequency meanwhile
+	if (hold && !no_set_time && clk.holdover() == 0)
+		Log::log(Log::HTTPDATE_NOTICE, "holding over at %.3fppm", clk.frequency());
+
+	return r;
+}
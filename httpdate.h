@@ -42,41 +42,196 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <time.h>
+#include <stdint.h>
 
+#include "discipline.h"
+#include "dns.h"
+#include "estimator.h"
+#include "metrics.h"
+#include "servers.h"
+#include "scheduler.h"
+#include "tls.h"
+
+
+// One measurement against one server, NTP style. All times in usec.
+struct time_sample {
+	// row in the server table
+	size_t idx;
+
+	// CLOCK_REALTIME at request send, CLOCK_MONOTONIC at send and when
+	// the segment carrying the Date header arrived
+	int64_t rt_send, mono_send, mono_recv;
+
+	// the servers clock, midpoint of its Date second
+	int64_t server;
+
+	// server - local midpoint of send/recv, the round trip delay
+	// and how far off the offset may be at most
+	int64_t offset, delay, error;
+
+	// of the server, 1 for plain web servers
+	int stratum;
+
+	// whether mono_recv is the kernels receive timestamp
+	bool stamped;
+
+	// votes in the estimate, and whether the server is trusted
+	int weight;
+	bool trusted;
+};
+
+
+// Outcome of the last round that produced an estimate. All in usec;
+// rt is CLOCK_REALTIME before any correction, mono CLOCK_MONOTONIC,
+// both 0 if there was none yet. delay is the lowest of all samples.
+struct round_result {
+	int64_t rt, mono;
+	int64_t offset, delay, error;
+	int used, samples, stratum;
+};
 
 
 class http_date {
-	std::map<struct addrinfo, std::string> servers;
+	server_table servers;
+	poll_scheduler sched;
+	dns_resolver resolver;
+
+	// sum of all corrections made to the clock, usec
+	int64_t applied;
+
 	bool no_set_time;
+	int boundary_probes, idle_limit, burst_samples;
+	Estimator::estimator_t est;
+
+	round_result last;
+
+	// outcome of the last round that adjusted the clock, and when
+	// (CLOCK_MONOTONIC usec)
+	bool synced;
+	int sync_stratum;
+	int64_t sync_error, sync_mono;
+
+	clock_discipline clk;
+
+	metrics stats;
+
+#ifdef USE_SSL
+	tls_client tls;
+#endif
 
 	std::ostringstream err;
 
+	size_t batch_size();
+
+	int tls_init(const server_config &);
+
+	int probe_batch(const std::vector<size_t> &, size_t, size_t, int, std::vector<time_sample> &);
+
 public:
-	http_date() : no_set_time(0), err("")
-	{};
+	http_date() : applied(0), no_set_time(0), boundary_probes(0), idle_limit(0), burst_samples(1),
+	              est(Estimator::EST_INTERSECT), synced(0), sync_stratum(16), sync_error(0), sync_mono(0), err("")
+	{
+		memset(&last, 0, sizeof(last));
+	};
 
 	virtual ~http_date();
 
-	int time_servers(const std::map<std::string, std::string> &);
+	int time_servers(const std::vector<server_config> &);
+
+	int refresh(int);
+
+	int reload(const std::vector<server_config> &, int);
 
 	int loop(int);
 
+	// CLOCK_MONOTONIC usec at which the next server is due
+	int64_t next_poll()
+	{
+		return sched.next(servers);
+	}
+
+	// shortest and longest poll interval, seconds
+	void poll_bounds(int mn, int mx)
+	{
+		sched.bounds(mn, mx);
+		sched.reset(servers);
+	}
+
+	// make every server due at once
+	void poll_now()
+	{
+		for (size_t i = 0; i < servers.size(); ++i)
+			servers.next_poll[i] = 0;
+		sched.reset(servers);
+	}
+
 	void no_set(bool b)
 	{
 		no_set_time = b;
 	}
 
-	static time_t average_time(const std::vector<time_t> &);
+	// number of extra requests per server to find its second boundary
+	void boundary(int n)
+	{
+		boundary_probes = n;
+	}
 
-	const char *why()
+	// samples per server and round, the clock filter keeps the best;
+	// at most as many as it has stages, so that it keeps a history
+	void burst(int n)
 	{
-		return err.str().c_str();
+		burst_samples = n < 1 ? 1 : (n > clock_filter::STAGES ? (int)clock_filter::STAGES : n);
 	}
 
+	// keep HTTP/1.1 connections across rounds if idle for at most n seconds
+	void keep_alive(int n)
+	{
+		idle_limit = n;
+	}
 
-};
+	void estimator(Estimator::estimator_t e)
+	{
+		est = e;
+	}
+
+	const round_result &result() const
+	{
+		return last;
+	}
+
+	const server_table &table() const
+	{
+		return servers;
+	}
+
+	// whether the clock was adjusted, the lowest stratum it was
+	// adjusted from, how far off it may have been then (usec) and when
+	// that was (CLOCK_MONOTONIC usec)
+	bool sync_state(int &s, int64_t &e, int64_t &when) const
+	{
+		s = sync_stratum;
+		e = sync_error;
+		when = sync_mono;
+		return synced;
+	}
+
+	clock_discipline &discipline()
+	{
+		return clk;
+	}
 
-bool operator<(struct addrinfo, struct addrinfo);
+	// write the Prometheus text file
+	int export_metrics(const std::string &);
+
+	static int average_time(const std::vector<time_sample> &, Estimator::estimator_t, Estimator::result &);
+
+	std::string why()
+	{
+		return err.str();
+	}
+
+
+};
 
 #endif
 
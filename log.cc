@@ -33,7 +33,18 @@
 #include <syslog.h>
 #include <string>
 #include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
 #include "log.h"
+#include "misc.h"
 
 
 namespace Log {
@@ -46,6 +57,106 @@ http_date_log_t how = HTTPDATE_SYSLOG;
 using namespace std;
 
 
+namespace {
+
+enum {
+	RING_SIZE	= 4096,
+	SLOT_SIZE	= 320
+};
+
+
+struct slot {
+	// Vyukov style sequence: pos when free, pos + 1 when filled
+	atomic<uint64_t> seq;
+	int64_t rt;
+	int level;
+	char msg[SLOT_SIZE];
+};
+
+
+struct ring {
+	slot slots[RING_SIZE];
+
+	// next to fill, next to drain
+	atomic<uint64_t> head;
+	uint64_t tail;
+
+	atomic<uint64_t> dropped;
+
+	ring() : head(0), tail(0), dropped(0)
+	{
+		for (uint64_t i = 0; i < RING_SIZE; ++i)
+			slots[i].seq.store(i, memory_order_relaxed);
+	}
+};
+
+
+ring rb;
+
+atomic<int> threshold(HTTPDATE_INFO);
+atomic<bool> held(0), running(0), kicked(0), pressed(0);
+int log_fd = -1;
+
+// serializes drain(), and wakes the drain thread
+mutex drain_lock, wake_lock;
+condition_variable wake;
+thread drainer;
+
+const char *names[] = {"err", "warning", "notice", "info", "debug"};
+
+const int priorities[] = {LOG_ERR, LOG_WARNING, LOG_NOTICE, LOG_INFO, LOG_DEBUG};
+
+
+void kick()
+{
+	if (kicked.exchange(1))
+		return;
+	lock_guard<mutex> g(wake_lock);
+	wake.notify_one();
+}
+
+
+void emit(int level, int64_t rt, const char *msg, string &file_buf)
+{
+	if (how == HTTPDATE_STDOUT) {
+		printf("%s\n", msg);
+	} else if (how == HTTPDATE_SYSLOG) {
+		if (!log_is_open) {
+			openlog("httpdated", LOG_NOWAIT|LOG_PID|LOG_NDELAY, LOG_DAEMON);
+			log_is_open = 1;
+		}
+		syslog(priorities[level], "%s", msg);
+	} else if (how == HTTPDATE_FILE) {
+		char ts[64];
+		time_t t = rt/1000000;
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		size_t n = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+		snprintf(ts + n, sizeof(ts) - n, ".%06lldZ level=%s ", (long long)(rt%1000000), names[level]);
+		file_buf += ts;
+		file_buf += msg;
+		file_buf += "\n";
+	}
+}
+
+
+void run()
+{
+	unique_lock<mutex> l(wake_lock);
+	while (running) {
+		wake.wait(l, []{ return kicked.load() || !running.load(); });
+		kicked = 0;
+		if (held && !pressed.exchange(0))
+			continue;
+		l.unlock();
+		drain();
+		l.lock();
+	}
+}
+
+}
+
+
 void init(http_date_log_t l)
 {
 	how = l;
@@ -57,20 +168,167 @@ void init(http_date_log_t l)
 }
 
 
+// opened before chroot, and kept
+int init(const string &path)
+{
+	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0640);
+	if (fd < 0)
+		return -1;
+	if (log_fd >= 0)
+		close(log_fd);
+	log_fd = fd;
+	how = HTTPDATE_FILE;
+	return 0;
+}
+
+
+void level(level_t l)
+{
+	threshold = l;
+}
+
+
+bool enabled(level_t l)
+{
+	return how != HTTPDATE_NOLOG && (int)l <= threshold.load(memory_order_relaxed);
+}
+
+
+int parse(const string &s, level_t &l)
+{
+	for (int i = HTTPDATE_ERR; i <= HTTPDATE_DEBUG; ++i) {
+		if (s == names[i]) {
+			l = (level_t)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+void log(level_t l, const char *fmt, ...)
+{
+	if (!enabled(l))
+		return;
+
+	uint64_t pos = rb.head.load(memory_order_relaxed);
+	slot *s = NULL;
+	for (;;) {
+		s = &rb.slots[pos & (RING_SIZE - 1)];
+		int64_t d = (int64_t)(s->seq.load(memory_order_acquire) - pos);
+		if (d == 0) {
+			if (rb.head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				break;
+		} else if (d < 0) {
+			rb.dropped.fetch_add(1, memory_order_relaxed);
+			return;
+		} else
+			pos = rb.head.load(memory_order_relaxed);
+	}
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(s->msg, sizeof(s->msg), fmt, ap);
+	va_end(ap);
+	s->rt = real_usec();
+	s->level = l;
+	s->seq.store(pos + 1, memory_order_release);
+
+	// While held, the drain thread is only woken each time another half
+	// of the ring filled up, so that a large round does not drop lines.
+	if (held) {
+		if (((pos + 1) & (RING_SIZE/2 - 1)) != 0)
+			return;
+		if (running) {
+			pressed = 1;
+			kick();
+		} else
+			drain();
+		return;
+	}
+	if (running)
+		kick();
+	else
+		drain();
+}
+
+
 void log(const string &msg)
 {
-	if (how == HTTPDATE_NOLOG)
+	log(HTTPDATE_INFO, "%s", msg.c_str());
+}
+
+
+void hold(bool h)
+{
+	held = h;
+	if (h)
 		return;
+	if (running)
+		kick();
+	else
+		drain();
+}
 
-	if (!log_is_open && how == HTTPDATE_SYSLOG) {
-		openlog("httpdated", LOG_NOWAIT|LOG_PID|LOG_NDELAY, LOG_DAEMON);
-		log_is_open = 1;
+
+void drain()
+{
+	lock_guard<mutex> g(drain_lock);
+	string file_buf = "";
+
+	for (;;) {
+		slot &s = rb.slots[rb.tail & (RING_SIZE - 1)];
+		if (s.seq.load(memory_order_acquire) != rb.tail + 1)
+			break;
+		emit(s.level, s.rt, s.msg, file_buf);
+		s.seq.store(rb.tail + RING_SIZE, memory_order_release);
+		++rb.tail;
+	}
+
+	uint64_t dropped = rb.dropped.exchange(0);
+	if (dropped > 0) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "log: %llu messages dropped", (unsigned long long)dropped);
+		emit(HTTPDATE_WARNING, real_usec(), msg, file_buf);
 	}
 
 	if (how == HTTPDATE_STDOUT)
-		printf("%s\n", msg.c_str());
-	else if (how == HTTPDATE_SYSLOG)
-		syslog(LOG_ERR, "%s", msg.c_str());
+		fflush(stdout);
+	else if (how == HTTPDATE_FILE && log_fd >= 0 && !file_buf.empty()) {
+		if (writen(log_fd, file_buf.c_str(), file_buf.size()) < 0)
+			return;
+	}
+}
+
+
+// threads do not survive fork(), so this comes after it
+int start()
+{
+	if (running || how == HTTPDATE_NOLOG)
+		return 0;
+	running = 1;
+	try {
+		drainer = thread(run);
+	} catch (...) {
+		running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+// flush what is left, e.g. at exit()
+void stop()
+{
+	if (running) {
+		{
+			lock_guard<mutex> g(wake_lock);
+			running = 0;
+			wake.notify_one();
+		}
+		drainer.join();
+	}
+	drain();
 }
 
 }
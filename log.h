@@ -40,14 +40,49 @@ namespace Log {
 typedef enum {
 	HTTPDATE_NOLOG = 0,
 	HTTPDATE_SYSLOG,
-	HTTPDATE_STDOUT
+	HTTPDATE_STDOUT,
+	HTTPDATE_FILE
 } http_date_log_t;
 
 
+typedef enum {
+	HTTPDATE_ERR = 0,
+	HTTPDATE_WARNING,
+	HTTPDATE_NOTICE,
+	HTTPDATE_INFO,
+	HTTPDATE_DEBUG
+} level_t;
+
+
+// Messages are formatted into the fixed size slots of a preallocated
+// lock-free ring, which never allocates nor blocks; when it is full they
+// are dropped and counted. drain() writes them out, from a thread of its
+// own once start()ed, inline otherwise. While held, the drain thread
+// only writes once half of the ring filled up, so that a measurement is
+// not delayed by log I/O, yet large pools do not lose lines.
+
 void log(const std::string &);
 
+void log(level_t, const char *, ...) __attribute__((format(printf, 2, 3)));
+
 void init(http_date_log_t);
 
+int init(const std::string &);
+
+void level(level_t);
+
+bool enabled(level_t);
+
+int parse(const std::string &, level_t &);
+
+void hold(bool);
+
+void drain();
+
+int start();
+
+void stop();
+
 }
 
 #endif
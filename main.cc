@@ -30,12 +30,14 @@
  * SUCH DAMAGE.
  */
 
-#include <map>
+#include <vector>
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #ifdef USE_CAPS
 #include <pwd.h>
@@ -48,6 +50,8 @@
 #include "misc.h"
 #include "config.h"
 #include "httpdate.h"
+#include "httpd.h"
+#include "shm.h"
 
 
 using namespace std;
@@ -56,10 +60,18 @@ using namespace std;
 
 void usage(const char *p)
 {
-	printf("\n%s\t[-R chroot (%s)] [-u user (%s)] [-s delay (%ds)]\n"
-	       "\t\t[-S time-frame (%ds)] <-T server/config> [-N] [-F]\n\n",
+	printf("\n%s\t[-R chroot (%s)] [-u user (%s)]\n"
+	       "\t\t[-s timeout (%ds)] [-w timeout in ms, instead of -s]\n"
+	       "\t\t[-m min poll interval (%ds)] [-S max poll interval (%ds)]\n"
+	       "\t\t[-B boundary probes (%d)] [-b burst samples (%d)] [-t step threshold (%dms)]\n"
+	       "\t\t[-K keep-alive idle limit (%ds)] [-E intersect|median|trimmed (%s)]\n"
+	       "\t\t[-P serve on port] [-d drift file in chroot (%s)] [-H SHM unit]\n"
+	       "\t\t[-O metrics file in chroot] [-L err|warning|notice|info|debug (%s)]\n"
+	       "\t\t[-l log file]\n"
+	       "\t\t<-T server/config> [-N] [-F] [-D]\n\n",
 	       p, Config::chroot.c_str(), Config::user.c_str(),
-	       Config::delay, Config::sleep);
+	       Config::delay/1000, Config::min_sleep, Config::sleep, Config::boundary, Config::burst, Config::step_threshold,
+	       Config::keep_alive, Config::estimator.c_str(), Config::drift.c_str(), Config::log_level.c_str());
 	exit(0);
 }
 
@@ -71,55 +83,83 @@ void die(const char *m)
 }
 
 
-void parse_time_server(const string &s, map<string, string> &ms)
+// -T files stay open, so that SIGHUP can read them again inside the
+// chroot. Servers given directly by -T are kept as they are.
+vector<int> config_fds;
+vector<string> config_files;
+vector<server_config> config_servers;
+
+volatile sig_atomic_t reload_config = 0;
+
+
+void sighup(int)
+{
+	reload_config = 1;
+}
+
+
+// A file, or a server line as in the file
+void parse_time_server(const string &s, vector<server_config> &vc)
 {
-	FILE *f = NULL;
-	char buf[64], *nl = NULL;
-	string::size_type n = string::npos;
-
-	// Not a file? Then it must be host~port
-	if ((f = fopen(s.c_str(), "r")) == NULL) {
-		if ((n = s.find("~")) != string::npos) {
-			if (n + 1 >= s.size())
-				ms[s.substr(0, n)] = "80";
-			else
-				ms[s.substr(0, n)] = s.substr(n + 1, s.size() - (n + 1));
-		} else
-				ms[s] = "80";
+	string e = "";
+	int fd = -1;
+
+	if ((fd = open(s.c_str(), O_RDONLY)) < 0) {
+		if (Config::parse_servers(s.c_str(), s.size(), "-T", config_servers, e) < 0 ||
+		    Config::parse_servers(s.c_str(), s.size(), "-T", vc, e) < 0) {
+			fprintf(stderr, "%s\n", e.c_str());
+			exit(1);
+		}
 		return;
 	}
+	config_fds.push_back(fd);
+	config_files.push_back(s);
+	if (Config::load_servers(fd, s, vc, e) < 0) {
+		fprintf(stderr, "%s\n", e.c_str());
+		exit(1);
+	}
+}
+
 
-	string line = "";
-	for (;!feof(f);) {
-		memset(buf, 0, sizeof(buf));
-		fgets(buf, sizeof(buf), f);
-		if (strlen(buf) <= 2 || *buf == '#')
-			continue;
-		if ((nl = strchr(buf, '\n')) != NULL)
-			*nl = 0;
-		if ((nl = strchr(buf, '#')) != NULL)
-			*nl = 0;
-		line = buf;
-		if ((n = line.find("~")) != string::npos) {
-			if (n + 1 >= line.size())
-				ms[line.substr(0, n)] = "80";
-			else
-				ms[line.substr(0, n)] = line.substr(n + 1, line.size() - (n + 1));
-		} else
-			ms[line] = "80";
+// Read the -T files again through their fds and switch to the new set.
+// Any error keeps the servers as they are.
+void reload(http_date &hd)
+{
+	vector<server_config> vc = config_servers;
+	struct stat st;
+	string e = "";
+
+	if (config_fds.empty()) {
+		Log::log(Log::HTTPDATE_NOTICE, "SIGHUP: no config file to reload");
+		return;
 	}
-	fclose(f);
+	for (size_t i = 0; i < config_fds.size(); ++i) {
+		// an editor that renames a new file over it leaves us the old one
+		if (fstat(config_fds[i], &st) == 0 && st.st_nlink == 0)
+			Log::log(Log::HTTPDATE_WARNING, "SIGHUP: %s was replaced, not edited in place; restart to pick it up",
+			         config_files[i].c_str());
+		if (Config::load_servers(config_fds[i], config_files[i], vc, e) < 0) {
+			Log::log(Log::HTTPDATE_WARNING, "SIGHUP: not reloading: %s", e.c_str());
+			return;
+		}
+	}
+	if (hd.reload(vc, Config::delay) < 0)
+		Log::log(Log::HTTPDATE_WARNING, "%s", hd.why().c_str());
 }
 
 
 int main(int argc, char **argv)
 {
 	http_date hd;
-	map<string, string> ms;
+	date_server ds;
+	shm_export shm;
+	vector<server_config> vc;
 	int c = 0, dev_null = 0;
+	int64_t published = 0;
+	bool jailed = 0;
 
 
-	while ((c = getopt(argc, argv, "FNT:s:S:u:R:")) != -1) {
+	while ((c = getopt(argc, argv, "DFNT:s:w:S:m:u:R:B:b:t:K:E:P:d:H:O:L:l:")) != -1) {
 		switch (c) {
 		case 'F':
 			Config::foreground = 1;
@@ -128,30 +168,103 @@ int main(int argc, char **argv)
 			Config::no_set = 1;
 			break;
 		case 'T':
-			parse_time_server(optarg, ms);
+			parse_time_server(optarg, vc);
 			break;
+		// seconds, as it always was; -w for less than that
 		case 's':
-			Config::delay = atoi(optarg);
+			if ((Config::delay = atoi(optarg)) < 1 || Config::delay > 60) {
+				fprintf(stderr, "-s takes seconds, 1 to 60; use -w for milliseconds\n");
+				exit(1);
+			}
+			Config::delay *= 1000;
+			break;
+		case 'w':
+			if ((Config::delay = atoi(optarg)) < 1) {
+				fprintf(stderr, "-w takes milliseconds, at least 1\n");
+				exit(1);
+			}
 			break;
 		case 'S':
 			Config::sleep = atoi(optarg);
 			break;
+		case 'm':
+			Config::min_sleep = atoi(optarg);
+			break;
 		case 'R':
 			Config::chroot = optarg;
 			break;
 		case 'u':
 			Config::user = optarg;
 			break;
+		case 'B':
+			Config::boundary = atoi(optarg);
+			break;
+		case 'b':
+			if ((Config::burst = atoi(optarg)) < 1 || Config::burst > clock_filter::STAGES) {
+				fprintf(stderr, "-b takes 1 to %d samples, as many as the clock filter holds\n", (int)clock_filter::STAGES);
+				exit(1);
+			}
+			break;
+		case 'D':
+			Config::slew = 1;
+			break;
+		case 't':
+			Config::step_threshold = atoi(optarg);
+			break;
+		case 'K':
+			Config::keep_alive = atoi(optarg);
+			break;
+		case 'E':
+			Config::estimator = optarg;
+			break;
+		case 'P':
+			Config::serve_port = optarg;
+			break;
+		case 'd':
+			Config::drift = optarg;
+			break;
+		case 'H':
+			Config::shm_unit = atoi(optarg);
+			break;
+		case 'O':
+			Config::metrics = optarg;
+			if (Config::metrics.rfind('/') == string::npos || Config::metrics.rfind('/') == 0) {
+				fprintf(stderr, "-O needs a directory below the chroot, e.g. /metrics/httpdated.prom\n");
+				exit(1);
+			}
+			break;
+		case 'L':
+			Config::log_level = optarg;
+			break;
+		case 'l':
+			Config::log_file = optarg;
+			break;
 		default:
 			usage(argv[0]);
 		}
 	}
 
-	if (ms.size() < 1)
+	if (vc.size() < 1)
 		usage(argv[0]);
 
-	if (hd.time_servers(ms) < 0)
-		die(hd.why());
+	Estimator::estimator_t est;
+	if (Estimator::parse(Config::estimator, est) < 0)
+		usage(argv[0]);
+	hd.estimator(est);
+
+	Log::level_t ll;
+	if (Log::parse(Config::log_level, ll) < 0)
+		usage(argv[0]);
+	Log::level(ll);
+
+	if (hd.time_servers(vc) < 0)
+		die(hd.why().c_str());
+
+	// privileged ports need root, so bind before dropping it
+	if (Config::serve_port.size() > 0 && ds.listen(Config::serve_port) < 0) {
+		fprintf(stderr, "%s\n", ds.why());
+		exit(1);
+	}
 
 	// important to open log before possibly chroot
 	if (!Config::foreground) {
@@ -159,11 +272,35 @@ int main(int argc, char **argv)
 		dev_null = open("/dev/null", O_RDWR);
 	} else
 		Log::init(Log::HTTPDATE_STDOUT);
+	if (Config::log_file.size() > 0 && Log::init(Config::log_file) < 0)
+		die(("open:" + Config::log_file).c_str());
 
 	if (geteuid())
 		Config::no_set = 1;
 
 	hd.no_set(Config::no_set);
+	hd.boundary(Config::boundary);
+	hd.burst(Config::burst);
+	hd.keep_alive(Config::keep_alive);
+	hd.discipline().slewing(Config::slew);
+	hd.discipline().threshold((int64_t)Config::step_threshold*1000);
+	hd.discipline().interval(Config::sleep);
+	hd.poll_bounds(Config::min_sleep, Config::sleep);
+
+	// segments stay attached across chroot and privilege drop
+	if (Config::shm_unit >= 0 && shm.attach(Config::shm_unit) < 0)
+		Log::log(Log::HTTPDATE_WARNING, "%s", shm.why());
+
+	// opened before chroot and kept, as we may not create files in there
+	if (!Config::no_set && Config::drift.size() > 0) {
+		string path = Config::drift;
+		if (Config::chroot != "/")
+			path = Config::chroot + "/" + Config::drift;
+		if (hd.discipline().drift(path) < 0)
+			Log::log(Log::HTTPDATE_WARNING, "%s", hd.discipline().why());
+		else if (hd.discipline().frequency_known())
+			Log::log(Log::HTTPDATE_NOTICE, "starting at %.3fppm from %s", hd.discipline().frequency(), path.c_str());
+	}
 
 	struct sigaction sa;
 	memset(&sa, 0, sizeof(sa));
@@ -171,8 +308,21 @@ int main(int argc, char **argv)
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGPIPE, &sa, NULL);
 	sigaction(SIGURG, &sa, NULL);
+
+	// sleep() returns early either way, so the reload is prompt. The
+	// restart is for the calls of the log and serving threads.
+	sa.sa_handler = sighup;
+	sa.sa_flags = SA_RESTART;
 	sigaction(SIGHUP, &sa, NULL);
 
+	string metrics_dir = "";
+	string::size_type slash = Config::metrics.rfind('/');
+	if (slash != string::npos && slash > 0) {
+		metrics_dir = Config::chroot + "/" + Config::metrics.substr(0, slash);
+		if (mkdir(metrics_dir.c_str(), 0755) < 0 && errno != EEXIST)
+			die("mkdir");
+	}
+
 #ifdef USE_CAPS
 
 	// It might be called as user to just print out web server times
@@ -184,11 +334,17 @@ int main(int argc, char **argv)
 		if (!pw)
 			die("unknown user:getpwnam");
 
+		// the metrics file is replaced by rename(), so its directory
+		// must be ours once we are no longer root
+		if (metrics_dir.size() > 0 && chown(metrics_dir.c_str(), pw->pw_uid, pw->pw_gid) < 0)
+			die("chown");
+
 		if (prctl(PR_SET_KEEPCAPS, 1, 0, 0, 0) < 0)
 			die("prctl");
 
 		if (chroot(Config::chroot.c_str()) < 0)
 			die("chroot");
+		jailed = 1;
 
 		if (setgid(pw->pw_gid) < 0)
 			die("setgid");
@@ -219,7 +375,7 @@ int main(int argc, char **argv)
 		if (fork() > 0)
 			exit(0);
 		setsid();
-		Log::log("started");
+		Log::log(Log::HTTPDATE_NOTICE, "started");
 
 		dup2(dev_null, 0);
 		dup2(dev_null, 1);
@@ -227,16 +383,72 @@ int main(int argc, char **argv)
 		close(dev_null);
 	}
 
+	string metrics_path = Config::metrics;
+	if (!jailed && Config::chroot != "/" && metrics_path.size() > 0)
+		metrics_path = Config::chroot + "/" + Config::metrics;
+
+	// threads do not survive fork()
+	if (Log::start() < 0)
+		die("Log::start");
+	atexit(Log::stop);
+	if (ds.enabled() && ds.start() < 0) {
+		Log::log(Log::HTTPDATE_ERR, "%s", ds.why());
+		exit(1);
+	}
+
 	for (;;) {
+		if (reload_config) {
+			reload_config = 0;
+			reload(hd);
+		}
+
 		if (hd.loop(Config::delay) < 0) {
-			Log::log(hd.why());
+			Log::log(Log::HTTPDATE_ERR, "%s", hd.why().c_str());
 			exit(1);
 		}
 
-		if (Config::foreground)
+		int stratum = 16;
+		int64_t error = 0, when = 0;
+		bool synced = hd.sync_state(stratum, error, when);
+		if (ds.enabled() && synced)
+			ds.sync(stratum, error, when);
+
+		if (metrics_path.size() > 0 && hd.export_metrics(metrics_path) < 0)
+			Log::log(Log::HTTPDATE_WARNING, "%s", hd.why().c_str());
+
+		const round_result &res = hd.result();
+		if (shm.enabled() && res.mono != published) {
+			httpdate_shm hs;
+			memset(&hs, 0, sizeof(hs));
+			hs.samples = res.samples;
+			hs.used = res.used;
+			hs.stratum = res.stratum;
+			hs.rt = res.rt;
+			hs.offset = res.offset;
+			hs.delay = res.delay;
+			hs.error = res.error;
+			hs.frequency = hd.discipline().frequency();
+			shm.publish(hs, synced);
+			published = res.mono;
+		}
+
+		// serving keeps us running in the foreground too
+		if (Config::foreground && !ds.enabled())
 			break;
 
-		sleep(Config::sleep);
+		// Between rounds and only within the time until the next server
+		// is due, so a slow nameserver never delays a measurement. Names
+		// still unanswered then are asked again after the next round.
+		int64_t next = hd.next_poll() - mono_usec();
+		if (next >= 1000) {
+			if (hd.refresh(next/1000 < Config::delay ? (int)(next/1000) : Config::delay) < 0)
+				Log::log(Log::HTTPDATE_WARNING, "%s", hd.why().c_str());
+			next = hd.next_poll() - mono_usec();
+		}
+
+		// until the next server is due
+		if (next > 0)
+			sleep((next + 999999)/1000000);
 	}
 
 	return 0;
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "servers.h"
+
+
+using namespace std;
+
+
+histogram::histogram() : count(0), sum(0)
+{
+	memset(b, 0, sizeof(b));
+}
+
+
+void histogram::add(int64_t v)
+{
+	size_t i = 0;
+
+	if (v < 0)
+		v = -v;
+	if (v < SUB) {
+		i = v;
+	} else {
+		int e = 63 - __builtin_clzll((uint64_t)v);
+		i = SUB*(e - 1) + ((v>>(e - 2)) & (SUB - 1));
+		if (i >= BUCKETS)
+			i = BUCKETS - 1;
+	}
+	++b[i];
+	++count;
+	sum += (double)v/1000000;
+}
+
+
+uint64_t histogram::below(int e) const
+{
+	uint64_t n = 0;
+	size_t last = e <= 2 ? (1<<e) - 1 : SUB*(e - 2) + SUB - 1;
+
+	for (size_t i = 0; i <= last && i < BUCKETS; ++i)
+		n += b[i];
+	return n;
+}
+
+
+metrics::metrics() : e(""), rounds(0), estimates(0), no_majority(0), no_samples(0), steps(0), slews(0),
+                     estimated(0), offset(0), error(0), frequency(0)
+{
+}
+
+
+metrics::~metrics()
+{
+}
+
+
+static void header(ostringstream &os, const char *name, const char *type, const char *help)
+{
+	os<<"# HELP httpdated_"<<name<<" "<<help<<"\n# TYPE httpdated_"<<name<<" "<<type<<"\n";
+}
+
+
+// label values may only carry \\, \" and \n escaped
+static string escape(const string &v)
+{
+	string r = "";
+	for (string::size_type i = 0; i < v.size(); ++i) {
+		if (v[i] == '\\')
+			r += "\\\\";
+		else if (v[i] == '"')
+			r += "\\\"";
+		else if (v[i] == '\n')
+			r += "\\n";
+		else
+			r += v[i];
+	}
+	return r;
+}
+
+
+// Exported at powers of four from 64us to 64s, which keeps the file small
+// with thousands of servers.
+static void buckets(ostringstream &os, const char *name, const string &labels, const histogram &h)
+{
+	string sep = labels.empty() ? "" : ",";
+	char le[32];
+
+	for (int e = 6; e <= 26; e += 2) {
+		snprintf(le, sizeof(le), "%.6f", (double)(1<<e)/1000000);
+		os<<"httpdated_"<<name<<"_bucket{"<<labels<<sep<<"le=\""<<le<<"\"} "<<h.below(e)<<"\n";
+	}
+	os<<"httpdated_"<<name<<"_bucket{"<<labels<<sep<<"le=\"+Inf\"} "<<h.count<<"\n";
+	os<<"httpdated_"<<name<<"_sum"<<(labels.empty() ? "" : "{" + labels + "}")<<" "<<h.sum<<"\n";
+	os<<"httpdated_"<<name<<"_count"<<(labels.empty() ? "" : "{" + labels + "}")<<" "<<h.count<<"\n";
+}
+
+
+int metrics::write(const string &path, const server_table &st)
+{
+	ostringstream os;
+	vector<string> labels;
+
+	os.precision(12);
+
+	for (size_t i = 0; i < st.size(); ++i)
+		labels.push_back("server=\"" + escape(st.label(i)) + "\"");
+
+	header(os, "rounds_total", "counter", "Probing rounds.");
+	os<<"httpdated_rounds_total "<<rounds<<"\n";
+	header(os, "round_duration_seconds", "histogram", "Duration of a probing round.");
+	buckets(os, "round_duration_seconds", "", round_time);
+	header(os, "estimates_total", "counter", "Outcome of combining the samples of a round.");
+	os<<"httpdated_estimates_total{result=\"ok\"} "<<estimates<<"\n"
+	  <<"httpdated_estimates_total{result=\"no_majority\"} "<<no_majority<<"\n"
+	  <<"httpdated_estimates_total{result=\"no_samples\"} "<<no_samples<<"\n";
+	header(os, "clock_adjustments_total", "counter", "Corrections of the local clock.");
+	os<<"httpdated_clock_adjustments_total{how=\"step\"} "<<steps<<"\n"
+	  <<"httpdated_clock_adjustments_total{how=\"slew\"} "<<slews<<"\n";
+
+	if (estimated) {
+		header(os, "offset_seconds", "gauge", "Last estimated offset of the local clock.");
+		os<<"httpdated_offset_seconds "<<(double)offset/1000000<<"\n";
+		header(os, "error_seconds", "gauge", "Error bound of the last estimate.");
+		os<<"httpdated_error_seconds "<<(double)error/1000000<<"\n";
+	}
+	header(os, "frequency_ppm", "gauge", "Kernel frequency correction.");
+	os<<"httpdated_frequency_ppm "<<frequency<<"\n";
+
+	header(os, "server_reach", "gauge", "Reachability register of the last 8 polls.");
+	for (size_t i = 0; i < st.size(); ++i)
+		os<<"httpdated_server_reach{"<<labels[i]<<"} "<<(unsigned)st.reach[i]<<"\n";
+	header(os, "server_poll_interval_seconds", "gauge", "Current poll interval.");
+	for (size_t i = 0; i < st.size(); ++i)
+		os<<"httpdated_server_poll_interval_seconds{"<<labels[i]<<"} "<<st.interval[i]<<"\n";
+	header(os, "server_offset_seconds", "gauge", "Offset of the last sample.");
+	for (size_t i = 0; i < st.size(); ++i) {
+		if (st.sampled[i] != 0)
+			os<<"httpdated_server_offset_seconds{"<<labels[i]<<"} "<<(double)st.offset[i]/1000000<<"\n";
+	}
+	header(os, "server_jitter_seconds", "gauge", "Jitter of the offsets in the clock filter.");
+	for (size_t i = 0; i < st.size(); ++i) {
+		if (st.sampled[i] != 0)
+			os<<"httpdated_server_jitter_seconds{"<<labels[i]<<"} "<<(double)st.jitter[i]/1000000<<"\n";
+	}
+	header(os, "server_polls_total", "counter", "Polls of the server.");
+	for (size_t i = 0; i < st.size(); ++i)
+		os<<"httpdated_server_polls_total{"<<labels[i]<<"} "<<st.stats[i].polls<<"\n";
+	header(os, "server_samples_total", "counter", "Usable samples from the server.");
+	for (size_t i = 0; i < st.size(); ++i)
+		os<<"httpdated_server_samples_total{"<<labels[i]<<"} "<<st.stats[i].samples<<"\n";
+	header(os, "server_kernel_stamped_total", "counter", "Samples timed by the kernel receive timestamp.");
+	for (size_t i = 0; i < st.size(); ++i)
+		os<<"httpdated_server_kernel_stamped_total{"<<labels[i]<<"} "<<st.stats[i].stamped<<"\n";
+	header(os, "server_errors_total", "counter", "Failed polls by cause.");
+	for (size_t i = 0; i < st.size(); ++i) {
+		const server_stats &s = st.stats[i];
+		os<<"httpdated_server_errors_total{"<<labels[i]<<",kind=\"connect\"} "<<s.connect_errors<<"\n"
+		  <<"httpdated_server_errors_total{"<<labels[i]<<",kind=\"timeout\"} "<<s.timeouts<<"\n"
+		  <<"httpdated_server_errors_total{"<<labels[i]<<",kind=\"read\"} "<<s.read_errors<<"\n"
+		  <<"httpdated_server_errors_total{"<<labels[i]<<",kind=\"parse\"} "<<s.parse_errors<<"\n"
+		  <<"httpdated_server_errors_total{"<<labels[i]<<",kind=\"slow\"} "<<s.dropped<<"\n";
+	}
+	header(os, "server_rtt_seconds", "histogram", "Round trip delay of the samples.");
+	for (size_t i = 0; i < st.size(); ++i)
+		buckets(os, "server_rtt_seconds", labels[i], st.stats[i].rtt);
+	header(os, "server_abs_offset_seconds", "histogram", "Absolute offset of the samples.");
+	for (size_t i = 0; i < st.size(); ++i)
+		buckets(os, "server_abs_offset_seconds", labels[i], st.stats[i].offset);
+
+	// write aside and rename over, so readers never see half a file
+	string tmp = path + ".tmp", s = os.str();
+	int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		e = "metrics::write::open:";
+		e += strerror(errno);
+		return -1;
+	}
+	if (::write(fd, s.c_str(), s.size()) != (ssize_t)s.size()) {
+		e = "metrics::write::write:";
+		e += strerror(errno);
+		close(fd);
+		unlink(tmp.c_str());
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		e = "metrics::write::rename:";
+		e += strerror(errno);
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
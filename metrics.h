@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include <string>
+#include <stdint.h>
+
+
+// Log-linear histogram of usec values, HDR style: four buckets per power
+// of two, so any value is off by less than 25% from its bucket.
+class histogram {
+
+public:
+
+	enum {
+		SUB	= 4,
+		BUCKETS	= 144
+	};
+
+	uint32_t b[BUCKETS];
+	uint64_t count;
+
+	// seconds
+	double sum;
+
+	histogram();
+
+	void add(int64_t);
+
+	// how many values were below 2^e usec
+	uint64_t below(int) const;
+};
+
+
+// Per-server counters, kept as a column of the server table
+struct server_stats {
+	uint64_t polls, samples, connect_errors, timeouts, read_errors, parse_errors, dropped;
+
+	// samples timed by the kernels receive timestamp
+	uint64_t stamped;
+
+	// round trip delay and absolute offset
+	histogram rtt, offset;
+
+	server_stats() : polls(0), samples(0), connect_errors(0), timeouts(0), read_errors(0),
+	                 parse_errors(0), dropped(0), stamped(0)
+	{
+	}
+};
+
+
+class server_table;
+
+
+// Daemon wide counters. Only the main thread updates them, one round at
+// a time, so they are plain integers. write() renders them together with
+// the per-server stats in Prometheus text format and atomically replaces
+// the file.
+class metrics {
+
+	std::string e;
+
+public:
+
+	uint64_t rounds, estimates, no_majority, no_samples, steps, slews;
+	histogram round_time;
+
+	// last estimate, usec and ppm
+	bool estimated;
+	int64_t offset, error;
+	double frequency;
+
+	metrics();
+
+	virtual ~metrics();
+
+	int write(const std::string &, const server_table &);
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+#endif
+
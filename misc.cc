@@ -35,6 +35,7 @@
 #include <cerrno>
 #include <cstring>
 #include <cstdio>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netinet/tcp.h>
@@ -72,6 +73,45 @@ int writen(int fd, const void *buf, size_t len)
 }
 
 
+// recv() that also returns the CLOCK_REALTIME usec at which the kernel
+// received the data, or 0 if it did not say
+ssize_t recv_stamped(int fd, char *buf, size_t n, int flags, int64_t &stamp)
+{
+	stamp = 0;
+#ifdef PROBE_TIMESTAMP
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(probe_stamp))];
+	} ctl;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	ssize_t r = recvmsg(fd, &msg, flags);
+	if (r <= 0 || (msg.msg_flags & MSG_CTRUNC))
+		return r;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == PROBE_SCM_TIMESTAMP &&
+		    c->cmsg_len >= CMSG_LEN(sizeof(probe_stamp))) {
+			probe_stamp t;
+			memcpy(&t, CMSG_DATA(c), sizeof(t));
+			stamp = PROBE_STAMP_USEC(t);
+		}
+	}
+	return r;
+#else
+	return recv(fd, buf, n, flags);
+#endif
+}
+
+
 int transfer_localtime(const char *root)
 {
 	char path[1024], buf[1024];
@@ -110,3 +150,20 @@ int transfer_localtime(const char *root)
 	return r;
 }
 
+
+// microseconds on the monotonic clock, unaffected by settimeofday()
+int64_t mono_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+int64_t real_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
@@ -34,12 +34,36 @@
 #define __misc_h__
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <time.h>
+
+// Kernel receive timestamps, so that a loaded host waking us up late
+// does not add to the delay. Linux has them in nsec, the BSDs in usec.
+#if defined(SO_TIMESTAMPNS)
+#define PROBE_TIMESTAMP SO_TIMESTAMPNS
+#define PROBE_SCM_TIMESTAMP SCM_TIMESTAMPNS
+typedef struct timespec probe_stamp;
+#define PROBE_STAMP_USEC(t) ((int64_t)(t).tv_sec*1000000 + (t).tv_nsec/1000)
+#elif defined(SO_TIMESTAMP)
+#define PROBE_TIMESTAMP SO_TIMESTAMP
+#define PROBE_SCM_TIMESTAMP SCM_TIMESTAMP
+typedef struct timeval probe_stamp;
+#define PROBE_STAMP_USEC(t) ((int64_t)(t).tv_sec*1000000 + (t).tv_usec)
+#endif
 
 int nonblock(int);
 
 int writen(int, const void *, size_t);
 
+ssize_t recv_stamped(int, char *, size_t, int, int64_t &);
+
 int transfer_localtime(const char *);
 
+int64_t mono_usec();
+
+int64_t real_usec();
+
 #endif
 
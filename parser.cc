@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+
+#include "parser.h"
+
+
+using namespace std;
+
+
+header_parser::header_parser() : buf(max_header), len(0), line(0), st(HP_MORE), major(0), minor(0),
+                                 status(0), date(NULL), date_len(0), date_recv(0), conn_close(0),
+                                 hires(0), rx(0), tx(0), error(0), stratum(0)
+{
+}
+
+
+header_parser::~header_parser()
+{
+}
+
+
+void header_parser::reset()
+{
+	len = line = 0;
+	st = HP_MORE;
+	major = minor = status = 0;
+	date = NULL;
+	date_len = 0;
+	date_recv = 0;
+	conn_close = 0;
+	hires = 0;
+	rx = tx = error = 0;
+	stratum = 0;
+}
+
+
+char *header_parser::space(size_t &n)
+{
+	n = buf.size() - len;
+	return &buf[len];
+}
+
+
+// Does a header value contain the token, ignoring case?
+static bool has_token(const char *v, size_t n, const char *tok)
+{
+	size_t tl = strlen(tok);
+
+	for (size_t i = 0; i + tl <= n; ++i) {
+		if (strncasecmp(v + i, tok, tl) != 0)
+			continue;
+		if ((i == 0 || v[i - 1] == ',' || v[i - 1] == ' ' || v[i - 1] == '\t') &&
+		    (i + tl == n || v[i + tl] == ',' || v[i + tl] == ' ' || v[i + tl] == '\t'))
+			return 1;
+	}
+	return 0;
+}
+
+
+// One line without its CRLF
+int header_parser::parse_line(const char *p, size_t n, int64_t t)
+{
+	// the status line: HTTP/x.y nnn reason
+	if (status == 0) {
+		if (n < 12 || strncmp(p, "HTTP/", 5) != 0 || p[6] != '.' || p[8] != ' ')
+			return HP_ERROR;
+		if (p[5] < '0' || p[5] > '9' || p[7] < '0' || p[7] > '9')
+			return HP_ERROR;
+		major = p[5] - '0';
+		minor = p[7] - '0';
+		for (size_t i = 9; i < 12; ++i) {
+			if (p[i] < '0' || p[i] > '9')
+				return HP_ERROR;
+			status = status*10 + p[i] - '0';
+		}
+		return status >= 100 ? HP_MORE : HP_ERROR;
+	}
+
+	if (n == 0)
+		return HP_DONE;
+
+	const char *colon = (const char *)memchr(p, ':', n);
+	if (colon == NULL)
+		return HP_MORE;
+
+	// optional whitespace around the value
+	size_t name = colon - p;
+	const char *v = colon + 1, *end = p + n;
+	while (v < end && (*v == ' ' || *v == '\t'))
+		++v;
+	while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+		--end;
+
+	if (name == 4 && strncasecmp(p, "date", 4) == 0) {
+		date = v;
+		date_len = end - v;
+		date_recv = t;
+	} else if (name == 10 && strncasecmp(p, "connection", 10) == 0)
+		conn_close = conn_close || has_token(v, end - v, "close");
+	else if (name == 10 && strncasecmp(p, "x-httpdate", 10) == 0)
+		parse_hires(v, end);
+
+	return HP_MORE;
+}
+
+
+// sec.usec with exactly six decimals, or -1
+static int64_t fixed_usec(const char *p, const char *end)
+{
+	int64_t v = 0;
+	const char *dot = (const char *)memchr(p, '.', end - p);
+
+	if (dot == NULL || dot == p || end - dot != 7 || dot - p > 12)
+		return -1;
+	for (; p < end; ++p) {
+		if (p == dot)
+			continue;
+		if (*p < '0' || *p > '9')
+			return -1;
+		v = v*10 + *p - '0';
+	}
+	return v;
+}
+
+
+// All four fields must be there and make sense, else the header is ignored
+void header_parser::parse_hires(const char *p, const char *end)
+{
+	int64_t v[4] = {-1, -1, -1, -1};
+	static const char *keys[4] = {"rx=", "tx=", "stratum=", "error="};
+
+	while (p < end) {
+		const char *sp = (const char *)memchr(p, ' ', end - p);
+		if (sp == NULL)
+			sp = end;
+		for (int i = 0; i < 4; ++i) {
+			size_t kl = strlen(keys[i]);
+			if ((size_t)(sp - p) <= kl || strncmp(p, keys[i], kl) != 0)
+				continue;
+			if (i == 2) {
+				v[i] = 0;
+				for (const char *d = p + kl; d < sp && v[i] >= 0; ++d)
+					v[i] = (*d >= '0' && *d <= '9' && d - p < 12) ? v[i]*10 + *d - '0' : -1;
+			} else
+				v[i] = fixed_usec(p + kl, sp);
+		}
+		p = sp + 1;
+	}
+
+	if (v[0] < 0 || v[1] < v[0] || v[2] < 1 || v[2] > 16 || v[3] < 0)
+		return;
+	hires = 1;
+	rx = v[0];
+	tx = v[1];
+	stratum = v[2];
+	error = v[3];
+}
+
+
+// Parse all lines completed by the new bytes. memchr() does the
+// scanning, which libc vectorizes.
+int header_parser::feed(size_t n, int64_t t)
+{
+	if (st != HP_MORE)
+		return st;
+
+	len += n;
+	for (;;) {
+		const char *p = &buf[line];
+		const char *nl = (const char *)memchr(p, '\n', len - line);
+		if (nl == NULL)
+			break;
+
+		size_t l = nl - p;
+		if (l > 0 && p[l - 1] == '\r')
+			--l;
+		line = nl - &buf[0] + 1;
+		if ((st = parse_line(p, l, t)) != HP_MORE)
+			return st;
+	}
+
+	if (len == buf.size())
+		st = HP_ERROR;
+	return st;
+}
+
+
+// Servers closing right after the header are fine as long as we have one.
+int header_parser::eof()
+{
+	if (st == HP_MORE)
+		st = status != 0 && line == len ? HP_DONE : HP_ERROR;
+	return st;
+}
+
+
+namespace {
+
+// three letters, case folded, as one integer
+constexpr uint32_t tag(char a, char b, char c)
+{
+	return (uint32_t)(a|0x20)<<16 | (uint32_t)(b|0x20)<<8 | (uint32_t)(c|0x20);
+}
+
+constexpr uint32_t day_tags[7] = {
+	tag('S','u','n'), tag('M','o','n'), tag('T','u','e'), tag('W','e','d'),
+	tag('T','h','u'), tag('F','r','i'), tag('S','a','t')
+};
+
+constexpr uint32_t month_tags[12] = {
+	tag('J','a','n'), tag('F','e','b'), tag('M','a','r'), tag('A','p','r'),
+	tag('M','a','y'), tag('J','u','n'), tag('J','u','l'), tag('A','u','g'),
+	tag('S','e','p'), tag('O','c','t'), tag('N','o','v'), tag('D','e','c')
+};
+
+// the long day names of RFC 850, without the common prefix
+const char *const day_rest[7] = {
+	"day", "day", "sday", "nesday", "rsday", "day", "urday"
+};
+
+constexpr int month_days[12] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+}
+
+
+static int day_index(const char *p)
+{
+	uint32_t t = tag(p[0], p[1], p[2]);
+	for (int i = 0; i < 7; ++i) {
+		if (day_tags[i] == t)
+			return i;
+	}
+	return -1;
+}
+
+
+static int month_index(const char *p)
+{
+	uint32_t t = tag(p[0], p[1], p[2]);
+	for (int i = 0; i < 12; ++i) {
+		if (month_tags[i] == t)
+			return i;
+	}
+	return -1;
+}
+
+
+// n digits, or -1
+static int digits(const char *p, int n)
+{
+	int v = 0;
+	for (int i = 0; i < n; ++i) {
+		if (p[i] < '0' || p[i] > '9')
+			return -1;
+		v = v*10 + p[i] - '0';
+	}
+	return v;
+}
+
+
+// HH:MM:SS
+static int clock_time(const char *p, int &h, int &m, int &s)
+{
+	if (p[2] != ':' || p[5] != ':')
+		return -1;
+	if ((h = digits(p, 2)) < 0 || (m = digits(p + 3, 2)) < 0 || (s = digits(p + 6, 2)) < 0)
+		return -1;
+	return 0;
+}
+
+
+// Days since 1970-01-01 of a proleptic Gregorian date, month 1..12.
+// From Howard Hinnant's chrono-compatible algorithms.
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399)/400;
+	unsigned yoe = (unsigned)(y - era*400);
+	unsigned doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d - 1;
+	unsigned doe = yoe*365 + yoe/4 - yoe/100 + doy;
+	return era*146097 + (int64_t)doe - 719468;
+}
+
+
+static bool leap(int y)
+{
+	return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+
+int parse_http_date(const char *p, size_t n, time_t &t)
+{
+	int wday = -1, mday = -1, mon = -1, year = -1, h = 0, m = 0, s = 0;
+
+	if (p == NULL || n < 24)
+		return -1;
+	if ((wday = day_index(p)) < 0)
+		return -1;
+
+	if (n == 29 && p[3] == ',') {
+		// IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+		if (p[4] != ' ' || p[7] != ' ' || p[11] != ' ' || p[16] != ' ' || p[25] != ' ')
+			return -1;
+		mday = digits(p + 5, 2);
+		mon = month_index(p + 8);
+		year = digits(p + 12, 4);
+		if (clock_time(p + 17, h, m, s) < 0 || strncmp(p + 26, "GMT", 3) != 0)
+			return -1;
+	} else if (n == 24 && p[3] == ' ') {
+		// asctime: Sun Nov  6 08:49:37 1994
+		if (p[7] != ' ' || p[10] != ' ' || p[19] != ' ')
+			return -1;
+		mon = month_index(p + 4);
+		mday = p[8] == ' ' ? digits(p + 9, 1) : digits(p + 8, 2);
+		year = digits(p + 20, 4);
+		if (clock_time(p + 11, h, m, s) < 0)
+			return -1;
+	} else {
+		// RFC 850: Sunday, 06-Nov-94 08:49:37 GMT
+		size_t rl = strlen(day_rest[wday]);
+		if (n != 3 + rl + 24 || strncasecmp(p + 3, day_rest[wday], rl) != 0)
+			return -1;
+		p += 3 + rl;
+		if (p[0] != ',' || p[1] != ' ' || p[4] != '-' || p[8] != '-' || p[11] != ' ' || p[20] != ' ')
+			return -1;
+		mday = digits(p + 2, 2);
+		mon = month_index(p + 5);
+		if ((year = digits(p + 9, 2)) < 0)
+			return -1;
+		// two digit years: 70..99 are the last century
+		year += year < 70 ? 2000 : 1900;
+		if (clock_time(p + 12, h, m, s) < 0 || strncmp(p + 21, "GMT", 3) != 0)
+			return -1;
+	}
+
+	if (mon < 0 || year < 1970 || mday < 1 || mday > month_days[mon])
+		return -1;
+	if (mon == 1 && mday == 29 && !leap(year))
+		return -1;
+	// allow a leap second
+	if (h > 23 || m > 59 || s > 60)
+		return -1;
+
+	// the day name has to match, 1970-01-01 was a Thursday
+	int64_t days = days_from_civil(year, mon + 1, mday);
+	if ((days + 4) % 7 != wday)
+		return -1;
+
+	int64_t secs = days*86400 + h*3600 + m*60 + s;
+	t = (time_t)secs;
+	if ((int64_t)t != secs)
+		return -1;
+	return 0;
+}
+
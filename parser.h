@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __parser_h__
+#define __parser_h__
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+#include <time.h>
+
+
+// Incremental HTTP/1.x response header parser. Bytes are read straight
+// into its buffer, complete lines are parsed in place as they arrive and
+// nothing is copied. The buffer is kept across requests on a connection.
+class header_parser {
+
+	std::vector<char> buf;
+
+	// bytes in buf, and where the first unparsed line starts
+	size_t len, line;
+
+	int st;
+
+	int parse_line(const char *, size_t, int64_t);
+
+	void parse_hires(const char *, const char *);
+
+public:
+
+	enum {
+		HP_ERROR	= -1,
+		HP_MORE		= 0,
+		HP_DONE		= 1
+	};
+
+	enum {
+		max_header	= 8192
+	};
+
+	// from the status line
+	int major, minor, status;
+
+	// the Date value, pointing into the buffer, and the CLOCK_MONOTONIC
+	// usec at which the segment completing the Date line was read
+	const char *date;
+	size_t date_len;
+	int64_t date_recv;
+
+	// Connection: close seen
+	bool conn_close;
+
+	// X-Httpdate: rx=<sec.usec> tx=<sec.usec> stratum=<n> error=<sec.usec>
+	// as sent by another httpdated: when it received our request and sent
+	// the answer by its clock, and how good that clock is. CLOCK_REALTIME
+	// usec.
+	bool hires;
+	int64_t rx, tx, error;
+	int stratum;
+
+	header_parser();
+
+	virtual ~header_parser();
+
+	void reset();
+
+	// where to read to, and how much fits
+	char *space(size_t &);
+
+	// n bytes were read into space() at time t
+	int feed(size_t, int64_t);
+
+	// peer closed the connection
+	int eof();
+
+	int state() const
+	{
+		return st;
+	}
+
+	// whether another request may follow on this connection
+	bool keep_alive() const
+	{
+		return st == HP_DONE && major == 1 && minor >= 1 && !conn_close;
+	}
+};
+
+
+// Decode an HTTP Date value in any of the three RFC 7231 formats:
+// IMF-fixdate, RFC 850 and asctime. Returns -1 on malformed input,
+// including a day name that does not match the date.
+int parse_http_date(const char *, size_t, time_t &);
+
+
+#endif
+
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <vector>
+#include <map>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "poller.h"
+
+
+using namespace std;
+
+
+poller::poller() : pfd(-1), e("")
+{
+}
+
+
+poller::~poller()
+{
+	if (pfd >= 0)
+		close(pfd);
+}
+
+
+#ifdef __linux__
+
+static uint32_t to_epoll(int what)
+{
+	uint32_t ev = 0;
+	if (what & poller::POLL_IN)
+		ev |= EPOLLIN;
+	if (what & poller::POLL_OUT)
+		ev |= EPOLLOUT;
+	return ev;
+}
+
+
+int poller::init()
+{
+	if ((pfd = epoll_create(1024)) < 0) {
+		e = "poller::init::epoll_create:";
+		e += strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+int poller::add(int fd, int what)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll(what);
+	ev.data.fd = fd;
+	if (epoll_ctl(pfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		e = "poller::add::epoll_ctl:";
+		e += strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+int poller::mod(int fd, int what)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll(what);
+	ev.data.fd = fd;
+	if (epoll_ctl(pfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		e = "poller::mod::epoll_ctl:";
+		e += strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+int poller::del(int fd)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	if (epoll_ctl(pfd, EPOLL_CTL_DEL, fd, &ev) < 0) {
+		e = "poller::del::epoll_ctl:";
+		e += strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+int poller::wait(vector<event> &v, int timeout)
+{
+	struct epoll_event evs[256];
+	event pe;
+
+	v.clear();
+
+	int n = epoll_wait(pfd, evs, sizeof(evs)/sizeof(evs[0]), timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		e = "poller::wait::epoll_wait:";
+		e += strerror(errno);
+		return -1;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		pe.fd = evs[i].data.fd;
+		pe.what = 0;
+		if (evs[i].events & EPOLLIN)
+			pe.what |= POLL_IN;
+		if (evs[i].events & EPOLLOUT)
+			pe.what |= POLL_OUT;
+		if (evs[i].events & (EPOLLERR|EPOLLHUP))
+			pe.what |= POLL_ERR;
+		v.push_back(pe);
+	}
+	return n;
+}
+
+#else
+
+static short to_poll(int what)
+{
+	short ev = 0;
+	if (what & poller::POLL_IN)
+		ev |= POLLIN;
+	if (what & poller::POLL_OUT)
+		ev |= POLLOUT;
+	return ev;
+}
+
+
+int poller::init()
+{
+	pfds.clear();
+	index.clear();
+	return 0;
+}
+
+
+int poller::add(int fd, int what)
+{
+	if (index.count(fd) > 0) {
+		e = "poller::add: fd already registered";
+		return -1;
+	}
+
+	struct pollfd p;
+	p.fd = fd;
+	p.events = to_poll(what);
+	p.revents = 0;
+	index[fd] = pfds.size();
+	pfds.push_back(p);
+	return 0;
+}
+
+
+int poller::mod(int fd, int what)
+{
+	map<int, size_t>::iterator i = index.find(fd);
+	if (i == index.end()) {
+		e = "poller::mod: fd not registered";
+		return -1;
+	}
+	pfds[i->second].events = to_poll(what);
+	return 0;
+}
+
+
+int poller::del(int fd)
+{
+	map<int, size_t>::iterator i = index.find(fd);
+	if (i == index.end()) {
+		e = "poller::del: fd not registered";
+		return -1;
+	}
+
+	// swap with last slot to keep the array dense
+	size_t idx = i->second;
+	index.erase(i);
+	if (idx != pfds.size() - 1) {
+		pfds[idx] = pfds.back();
+		index[pfds[idx].fd] = idx;
+	}
+	pfds.pop_back();
+	return 0;
+}
+
+
+int poller::wait(vector<event> &v, int timeout)
+{
+	event pe;
+
+	v.clear();
+
+	int n = poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		e = "poller::wait::poll:";
+		e += strerror(errno);
+		return -1;
+	}
+
+	for (size_t i = 0; i < pfds.size() && (int)v.size() < n; ++i) {
+		if (pfds[i].revents == 0)
+			continue;
+		pe.fd = pfds[i].fd;
+		pe.what = 0;
+		if (pfds[i].revents & POLLIN)
+			pe.what |= POLL_IN;
+		if (pfds[i].revents & POLLOUT)
+			pe.what |= POLL_OUT;
+		if (pfds[i].revents & (POLLERR|POLLHUP|POLLNVAL))
+			pe.what |= POLL_ERR;
+		v.push_back(pe);
+	}
+	return (int)v.size();
+}
+
+#endif
+
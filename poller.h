@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __poller_h__
+#define __poller_h__
+
+#include <vector>
+#include <map>
+#include <string>
+#include <stdint.h>
+
+#ifndef __linux__
+#include <poll.h>
+#endif
+
+
+// Thin readiness notification wrapper. epoll on Linux, poll(2)
+// everywhere else so that the BSD build keeps working.
+class poller {
+
+	int pfd;
+
+#ifndef __linux__
+	std::vector<struct pollfd> pfds;
+	std::map<int, size_t> index;
+#endif
+
+	std::string e;
+
+public:
+
+	enum {
+		POLL_IN		= 1,
+		POLL_OUT	= 2,
+		POLL_ERR	= 4
+	};
+
+	struct event {
+		int fd;
+		int what;
+	};
+
+	poller();
+
+	virtual ~poller();
+
+	int init();
+
+	int add(int, int);
+
+	int mod(int, int);
+
+	int del(int);
+
+	int wait(std::vector<event> &, int);
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+#endif
+
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <queue>
+#include <vector>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "scheduler.h"
+
+
+using namespace std;
+
+
+poll_scheduler::poll_scheduler() : min_interval(1024), max_interval(60*60*6), rnd(0)
+{
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, &rnd, sizeof(rnd)) != sizeof(rnd))
+		rnd = (uint32_t)(getpid() ^ mono_usec());
+	if (fd >= 0)
+		close(fd);
+	if (rnd == 0)
+		rnd = 1;
+}
+
+
+poll_scheduler::~poll_scheduler()
+{
+}
+
+
+void poll_scheduler::bounds(int mn, int mx)
+{
+	if (mx < 1)
+		mx = 1;
+	if (mn < 1)
+		mn = 1;
+	if (mn > mx)
+		mn = mx;
+	min_interval = mn;
+	max_interval = mx;
+}
+
+
+// interval seconds in usec, +/-12.5% (xorshift32)
+int64_t poll_scheduler::spread(int seconds)
+{
+	rnd ^= rnd<<13;
+	rnd ^= rnd>>17;
+	rnd ^= rnd<<5;
+
+	int64_t usec = (int64_t)seconds*1000000;
+	return usec - usec/8 + (int64_t)((double)rnd/4294967296.0*(usec/4));
+}
+
+
+// the bounds configured for the row, else the global ones
+void poll_scheduler::limits(const server_table &st, size_t row, int &lo, int &hi) const
+{
+	const server_options &o = st.opt(row);
+	lo = o.minpoll > 0 ? o.minpoll : min_interval;
+	hi = o.maxpoll > 0 ? o.maxpoll : max_interval;
+	if (hi < lo)
+		hi = lo;
+}
+
+
+void poll_scheduler::schedule(server_table &st, size_t row, int64_t now)
+{
+	st.next_poll[row] = now + spread(st.interval[row]);
+	heap.push(timer(st.next_poll[row], row));
+}
+
+
+// Rebuild the heap, e.g. after the table changed. Rows new to the table
+// or not polled yet are due at once and start at the shortest interval.
+// Rows carried over keep their interval and next poll, so a server that
+// never answers does not lose its back-off when the addresses of a name
+// change.
+void poll_scheduler::reset(server_table &st)
+{
+	heap = priority_queue<timer, vector<timer>, greater<timer> >();
+	int64_t now = mono_usec();
+	int lo = 0, hi = 0;
+	for (size_t i = 0; i < st.size(); ++i) {
+		limits(st, i, lo, hi);
+		if (st.interval[i] == 0 || st.next_poll[i] == 0) {
+			st.interval[i] = lo;
+			st.next_poll[i] = 0;
+		} else if (st.interval[i] < lo)
+			st.interval[i] = lo;
+		else if (st.interval[i] > hi) {
+			st.interval[i] = hi;
+			if (st.next_poll[i] > now + (int64_t)hi*1000000)
+				st.next_poll[i] = now + spread(hi);
+		}
+		heap.push(timer(st.next_poll[i], i));
+	}
+}
+
+
+// Pop all servers due by now. They are rescheduled by sampled() or missed().
+void poll_scheduler::due(server_table &st, int64_t now, vector<size_t> &rows)
+{
+	rows.clear();
+	while (!heap.empty() && heap.top().first <= now) {
+		timer t = heap.top();
+		heap.pop();
+		if (t.second < st.size() && st.next_poll[t.second] == t.first)
+			rows.push_back(t.second);
+	}
+}
+
+
+// A sample arrived. offset is the one selected by the clock filter,
+// relative to the current clock, jitter that of the filter and error
+// the bound of the sample (usec).
+void poll_scheduler::sampled(server_table &st, size_t row, int64_t offset, int64_t jitter, int64_t error)
+{
+	int64_t floor = 1000;
+	int lo = 0, hi = 0;
+
+	limits(st, row, lo, hi);
+	st.jitter[row] = jitter;
+
+	// off by more than the sample can explain, or jittery: look closer
+	if (llabs(offset) > 2*error + floor || st.jitter[row] > error + floor) {
+		st.good[row] = 0;
+		st.interval[row] = max(st.interval[row]/2, lo);
+	} else if (++st.good[row] >= 4) {
+		st.good[row] = 0;
+		st.interval[row] = min(st.interval[row]*2 > 0 ? st.interval[row]*2 : hi, hi);
+	}
+	schedule(st, row, mono_usec());
+}
+
+
+void poll_scheduler::missed(server_table &st, size_t row, int64_t now)
+{
+	int lo = 0, hi = 0;
+
+	limits(st, row, lo, hi);
+	st.good[row] = 0;
+	st.interval[row] = min(st.interval[row]*2 > 0 ? st.interval[row]*2 : hi, hi);
+	schedule(st, row, now);
+}
+
+
+int64_t poll_scheduler::next(const server_table &st)
+{
+	while (!heap.empty()) {
+		const timer &t = heap.top();
+		if (t.second < st.size() && st.next_poll[t.second] == t.first)
+			return t.first;
+		heap.pop();
+	}
+	// nothing to poll, e.g. no name resolved after a reload: come back
+	// after the shortest interval, so the names are tried again
+	return mono_usec() + (int64_t)min_interval*1000000;
+}
+
+
+int poll_scheduler::shortest(const server_table &st) const
+{
+	int s = max_interval;
+	for (size_t i = 0; i < st.size(); ++i)
+		s = min(s, (int)st.interval[i]);
+	return s;
+}
+
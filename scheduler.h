@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __scheduler_h__
+#define __scheduler_h__
+
+#include <queue>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <stdint.h>
+
+#include "servers.h"
+
+
+// Decides when each server is polled next, NTP style. The interval of a
+// server shrinks while its offset or jitter is high and grows once it
+// is stable, between the min and max bounds. Unreachable servers back
+// off exponentially. Every interval is randomized by +/-12.5% so that a
+// fleet started at once spreads out. A server may bring its own bounds.
+class poll_scheduler {
+
+	// next poll, row; stale entries are skipped lazily
+	typedef std::pair<int64_t, size_t> timer;
+	std::priority_queue<timer, std::vector<timer>, std::greater<timer> > heap;
+
+	// seconds
+	int min_interval, max_interval;
+
+	uint32_t rnd;
+
+	int64_t spread(int);
+
+	void limits(const server_table &, size_t, int &, int &) const;
+
+	void schedule(server_table &, size_t, int64_t);
+
+public:
+
+	poll_scheduler();
+
+	virtual ~poll_scheduler();
+
+	void bounds(int, int);
+
+	void reset(server_table &);
+
+	void due(server_table &, int64_t, std::vector<size_t> &);
+
+	void sampled(server_table &, size_t, int64_t, int64_t, int64_t);
+
+	void missed(server_table &, size_t, int64_t);
+
+	// CLOCK_MONOTONIC usec of the next poll, a min interval from now if
+	// nothing is scheduled
+	int64_t next(const server_table &);
+
+	// the shortest interval currently in use
+	int shortest(const server_table &) const;
+};
+
+
+#endif
+
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "servers.h"
+
+
+using namespace std;
+
+
+server_table::server_table()
+{
+}
+
+
+server_table::~server_table()
+{
+	close_all();
+}
+
+
+// Only the address and port, never padding or scope garbage
+string server_table::key(const struct sockaddr *sa, socklen_t len)
+{
+	string k = "";
+	if (sa->sa_family == AF_INET && len >= sizeof(struct sockaddr_in)) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+		k.assign((const char *)&sin->sin_addr, sizeof(sin->sin_addr));
+		k.append((const char *)&sin->sin_port, sizeof(sin->sin_port));
+	} else if (sa->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6)) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+		k.assign((const char *)&sin6->sin6_addr, sizeof(sin6->sin6_addr));
+		k.append((const char *)&sin6->sin6_port, sizeof(sin6->sin6_port));
+		k.append((const char *)&sin6->sin6_scope_id, sizeof(sin6->sin6_scope_id));
+	}
+	return k;
+}
+
+
+// A name already known keeps its first options
+uint32_t server_table::add_name(const string &name, const string &port, bool https, const server_options &opt)
+{
+	string k = name;
+	k += '\0';
+	k += port;
+	k += https ? 's' : '\0';
+
+	map<string, uint32_t>::iterator i = name_index.find(k);
+	if (i != name_index.end())
+		return i->second;
+
+	names.push_back(name);
+	ports.push_back(port);
+	tls.push_back(https);
+	options.push_back(opt);
+	name_index[k] = names.size() - 1;
+	return names.size() - 1;
+}
+
+
+// Returns the row of the address. dup is set if it was already known,
+// e.g. because two names share an address.
+size_t server_table::add(const struct sockaddr *sa, socklen_t len, uint32_t h, bool &dup)
+{
+	string k = key(sa, len);
+	map<string, size_t>::iterator i = index.find(k);
+
+	if ((dup = (i != index.end())))
+		return i->second;
+
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	memcpy(&ss, sa, len < sizeof(ss) ? len : sizeof(ss));
+
+	addr.push_back(ss);
+	addr_len.push_back(len);
+	host.push_back(h);
+	labels.push_back(names[h] + "[" + address(addr.size() - 1) + "]");
+	fd.push_back(-1);
+	last_used.push_back(0);
+	reach.push_back(0);
+	offset.push_back(0);
+	delay.push_back(0);
+	error.push_back(0);
+	sampled.push_back(0);
+	applied.push_back(0);
+	stratum.push_back(16);
+	filter.push_back(clock_filter());
+	next_poll.push_back(0);
+	interval.push_back(0);
+	jitter.push_back(0);
+	good.push_back(0);
+	stats.push_back(server_stats());
+
+	index[k] = addr.size() - 1;
+	return addr.size() - 1;
+}
+
+
+bool server_table::find(const struct sockaddr *sa, socklen_t len, size_t &row) const
+{
+	map<string, size_t>::const_iterator i = index.find(key(sa, len));
+	if (i == index.end())
+		return 0;
+	row = i->second;
+	return 1;
+}
+
+
+string server_table::address(size_t row) const
+{
+	char a[NI_MAXHOST];
+	if (getnameinfo((const struct sockaddr *)&addr[row], addr_len[row], a, sizeof(a), NULL, 0, NI_NUMERICHOST) != 0)
+		return "?";
+	return a;
+}
+
+
+void server_table::close_all()
+{
+	for (size_t i = 0; i < fd.size(); ++i) {
+		if (fd[i] >= 0)
+			close(fd[i]);
+		fd[i] = -1;
+	}
+}
+
+
+// Carry connection and state of row r in o over to row, e.g. when
+// the address is still in use after re-resolving.
+void server_table::take(size_t row, server_table &o, size_t r)
+{
+	fd[row] = o.fd[r];
+	o.fd[r] = -1;
+	last_used[row] = o.last_used[r];
+	reach[row] = o.reach[r];
+	offset[row] = o.offset[r];
+	delay[row] = o.delay[r];
+	error[row] = o.error[r];
+	sampled[row] = o.sampled[r];
+	applied[row] = o.applied[r];
+	stratum[row] = o.stratum[r];
+	filter[row] = o.filter[r];
+	next_poll[row] = o.next_poll[r];
+	interval[row] = o.interval[r];
+	jitter[row] = o.jitter[r];
+	good[row] = o.good[r];
+	stats[row] = o.stats[r];
+}
+
+
+void server_table::swap(server_table &o)
+{
+	index.swap(o.index);
+	name_index.swap(o.name_index);
+	names.swap(o.names);
+	ports.swap(o.ports);
+	tls.swap(o.tls);
+	options.swap(o.options);
+	addr.swap(o.addr);
+	addr_len.swap(o.addr_len);
+	host.swap(o.host);
+	labels.swap(o.labels);
+	fd.swap(o.fd);
+	last_used.swap(o.last_used);
+	reach.swap(o.reach);
+	offset.swap(o.offset);
+	delay.swap(o.delay);
+	error.swap(o.error);
+	sampled.swap(o.sampled);
+	applied.swap(o.applied);
+	stratum.swap(o.stratum);
+	filter.swap(o.filter);
+	next_poll.swap(o.next_poll);
+	interval.swap(o.interval);
+	jitter.swap(o.jitter);
+	good.swap(o.good);
+	stats.swap(o.stats);
+}
+
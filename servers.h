@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __servers_h__
+#define __servers_h__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "filter.h"
+
+
+// Per name settings from the config, 0 standing for the global default
+struct server_options {
+	// AF_UNSPEC, AF_INET or AF_INET6
+	int family;
+
+	// votes of its samples in the estimate
+	int weight;
+
+	// poll interval bounds (seconds), and samples per round
+	int minpoll, maxpoll, burst;
+
+	// trusted samples decide if there is no majority; noselect ones are
+	// measured, but never used
+	bool trusted, noselect;
+
+	server_options() : family(AF_UNSPEC), weight(1), minpoll(0), maxpoll(0), burst(0), trusted(0), noselect(0)
+	{
+	}
+};
+
+
+// A name as configured
+struct server_config {
+	std::string name, port;
+	bool https;
+	server_options opt;
+};
+
+
+// All time server addresses, index addressed and stored column wise
+// so that a round over thousands of them stays cache friendly. Rows are
+// unique per address and port, no matter how many names resolve to them.
+class server_table {
+
+	// raw address + port -> row
+	std::map<std::string, size_t> index;
+
+	// name, port and protocol -> index into names
+	std::map<std::string, uint32_t> name_index;
+
+	static std::string key(const struct sockaddr *, socklen_t);
+
+public:
+
+	// the names as configured, their ports, whether they speak HTTPS
+	// and their options
+	std::vector<std::string> names, ports;
+	std::vector<uint8_t> tls;
+	std::vector<server_options> options;
+
+	// per server
+	std::vector<struct sockaddr_storage> addr;
+	std::vector<socklen_t> addr_len;
+
+	// index into names, and host[address] for logging
+	std::vector<uint32_t> host;
+	std::vector<std::string> labels;
+
+	// kept-alive connection or -1, and when it was last used
+	// (CLOCK_MONOTONIC usec)
+	std::vector<int> fd;
+	std::vector<int64_t> last_used;
+
+	// NTP style reachability shift register, and the last sample (usec).
+	// sampled is when it was taken (CLOCK_MONOTONIC usec, 0 for never),
+	// applied the sum of clock corrections made until then.
+	std::vector<uint8_t> reach;
+	std::vector<int64_t> offset, delay, error, sampled, applied;
+	std::vector<int> stratum;
+
+	// the recent samples the last one was selected from
+	std::vector<clock_filter> filter;
+
+	// poll schedule: next poll (CLOCK_MONOTONIC usec), current interval
+	// (seconds), jitter of the clock filter (usec) and good samples in a row
+	std::vector<int64_t> next_poll;
+	std::vector<int32_t> interval;
+	std::vector<int64_t> jitter;
+	std::vector<uint8_t> good;
+
+	// counters and histograms for the metrics export
+	std::vector<server_stats> stats;
+
+	server_table();
+
+	virtual ~server_table();
+
+	size_t size() const
+	{
+		return addr.size();
+	}
+
+	uint32_t add_name(const std::string &, const std::string &, bool, const server_options &);
+
+	size_t add(const struct sockaddr *, socklen_t, uint32_t, bool &);
+
+	bool find(const struct sockaddr *, socklen_t, size_t &) const;
+
+	std::string address(size_t) const;
+
+	const std::string &label(size_t row) const
+	{
+		return labels[row];
+	}
+
+	// of the name the row was first added for
+	const server_options &opt(size_t row) const
+	{
+		return options[host[row]];
+	}
+
+	void close_all();
+
+	void take(size_t, server_table &, size_t);
+
+	void swap(server_table &);
+};
+
+
+#endif
+
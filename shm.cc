@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "misc.h"
+#include "shm.h"
+
+
+using namespace std;
+
+
+shm_export::shm_export() : ntp(NULL), native(NULL), e("")
+{
+}
+
+
+shm_export::~shm_export()
+{
+	if (ntp)
+		shmdt(ntp);
+	if (native)
+		shmdt(native);
+}
+
+
+// Units 0 and 1 are root only, as ntpd and chrony expect
+static void *attach_key(key_t key, size_t size, int unit, string &e)
+{
+	int id = shmget(key, size, IPC_CREAT|(unit < 2 ? 0600 : 0644));
+	if (id < 0) {
+		e = "shm_export::attach::shmget:";
+		e += strerror(errno);
+		return NULL;
+	}
+	void *p = shmat(id, NULL, 0);
+	if (p == (void *)-1) {
+		e = "shm_export::attach::shmat:";
+		e += strerror(errno);
+		return NULL;
+	}
+	return p;
+}
+
+
+int shm_export::attach(int unit)
+{
+	if ((ntp = (ntp_shm *)attach_key(NTP_KEY + unit, sizeof(ntp_shm), unit, e)) == NULL)
+		return -1;
+	if ((native = (httpdate_shm *)attach_key(NATIVE_KEY + unit, sizeof(httpdate_shm), unit, e)) == NULL) {
+		shmdt(ntp);
+		ntp = NULL;
+		return -1;
+	}
+
+	memset(ntp, 0, sizeof(*ntp));
+	ntp->mode = 1;
+	memset(native, 0, sizeof(*native));
+	native->magic = MAGIC;
+	native->version = VERSION;
+	return 0;
+}
+
+
+void shm_export::publish(const httpdate_shm &r, bool synced)
+{
+	if (!enabled())
+		return;
+
+	// seqlock: odd while writing, fences keep the stores inside
+	uint32_t seq = native->seq;
+	native->seq = seq + 1;
+	atomic_thread_fence(memory_order_release);
+	native->samples = r.samples;
+	native->used = r.used;
+	native->stratum = r.stratum;
+	native->rt = r.rt;
+	native->offset = r.offset;
+	native->delay = r.delay;
+	native->error = r.error;
+	native->frequency = r.frequency;
+	native->updated = real_usec();
+	native->mono = mono_usec();
+	atomic_thread_fence(memory_order_release);
+	native->seq = seq + 2;
+
+	// The NTP driver wants the true time and the local clock of the
+	// same instant. Mode 1: count brackets the update, valid marks it new.
+	int64_t clk = r.rt + r.offset;
+	int precision = -30;
+	if (r.error > 0)
+		precision = (int)floor(log2((double)r.error/1000000));
+	if (precision < -30)
+		precision = -30;
+	if (precision > 0)
+		precision = 0;
+
+	ntp->valid = 0;
+	++ntp->count;
+	atomic_thread_fence(memory_order_release);
+	ntp->clockTimeStampSec = clk/1000000;
+	ntp->clockTimeStampUSec = clk%1000000;
+	ntp->clockTimeStampNSec = (clk%1000000)*1000;
+	ntp->receiveTimeStampSec = r.rt/1000000;
+	ntp->receiveTimeStampUSec = r.rt%1000000;
+	ntp->receiveTimeStampNSec = (r.rt%1000000)*1000;
+	ntp->leap = synced ? 0 : 3;
+	ntp->precision = precision;
+	ntp->nsamples = r.used;
+	atomic_thread_fence(memory_order_release);
+	++ntp->count;
+	ntp->valid = 1;
+}
+
+
+bool shm_export::read(const httpdate_shm *p, httpdate_shm &r)
+{
+	for (int tries = 0; tries < 1000; ++tries) {
+		uint32_t seq = p->seq;
+		atomic_thread_fence(memory_order_acquire);
+		if (seq & 1)
+			continue;
+		memcpy(&r, (const void *)p, sizeof(r));
+		atomic_thread_fence(memory_order_acquire);
+		if (p->seq == seq)
+			return r.magic == MAGIC;
+	}
+	return 0;
+}
+
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __shm_h__
+#define __shm_h__
+
+#include <string>
+#include <atomic>
+#include <time.h>
+#include <stdint.h>
+
+
+// Segment of ntpd's and chrony's SHM refclock driver, mode 1
+struct ntp_shm {
+	int mode;
+	volatile int count;
+	time_t clockTimeStampSec;
+	int clockTimeStampUSec;
+	time_t receiveTimeStampSec;
+	int receiveTimeStampUSec;
+	int leap;
+	int precision;
+	int nsamples;
+	volatile int valid;
+	unsigned clockTimeStampNSec;
+	unsigned receiveTimeStampNSec;
+	int dummy[8];
+};
+
+
+// Our own segment. seq is odd while it is written; readers copy it and
+// retry if seq was odd or changed meanwhile. See shm_export::read().
+// Times in usec, updated and rt are CLOCK_REALTIME, mono CLOCK_MONOTONIC.
+struct httpdate_shm {
+	uint32_t magic, version;
+	volatile uint32_t seq;
+	uint32_t samples, used;
+	int32_t stratum;
+
+	// clock at the time of the sample, and our estimate of the true time then
+	// minus that: offset +/- error, from samples with a round trip of delay
+	int64_t rt, offset, delay, error;
+
+	// when published
+	int64_t updated, mono;
+
+	// kernel frequency correction, ppm
+	double frequency;
+};
+
+
+// Publishes each result into SysV shared memory, attached while still
+// root and written lock-free afterwards, so slow readers never block us.
+class shm_export {
+
+	ntp_shm *ntp;
+	httpdate_shm *native;
+
+	std::string e;
+
+public:
+
+	enum {
+		NTP_KEY		= 0x4e545030,	// "NTP0"
+		NATIVE_KEY	= 0x48545030,	// "HTP0"
+		MAGIC		= 0x68747064,	// "htpd"
+		VERSION		= 1
+	};
+
+	shm_export();
+
+	virtual ~shm_export();
+
+	int attach(int);
+
+	bool enabled() const
+	{
+		return ntp != NULL;
+	}
+
+	void publish(const httpdate_shm &, bool);
+
+	// consistent copy of the native segment, never blocks
+	static bool read(const httpdate_shm *, httpdate_shm &);
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+#endif
+
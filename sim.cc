@@ -0,0 +1,1096 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// httpdate-sim: runs http_date against a farm of mock HTTP time servers on
+// loopback, each with its own clock, latency, loss and header quirks, some
+// of them lying, and reports how close and how fast the estimate gets to
+// the truth. Nothing leaves the machine and the clock is never touched.
+
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <functional>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "misc.h"
+#include "poller.h"
+#include "parser.h"
+#include "httpd.h"
+#include "httpdate.h"
+
+#ifdef USE_SSL
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#endif
+
+
+using namespace std;
+
+
+namespace {
+
+enum {
+	Q_NONE = 0,
+	Q_LOWER,
+	Q_SPLIT,
+	Q_RFC850,
+	Q_ASCTIME,
+	Q_NODATE,
+	Q_CLOSE,
+	Q_MAX
+};
+
+const char *quirk_names[] = {"none", "lower", "split", "rfc850", "asctime", "nodate", "close"};
+
+// IMF-fixdate, RFC 850 and asctime, as the mocks send them
+const char *date_formats[3] = {"%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y"};
+
+
+// one mock time server
+struct mock {
+	int lfd;
+	string host, port;
+
+	// clock relative to the farms, one way latency, usec
+	int64_t skew, latency;
+	int quirk;
+	bool liar, hires, tls;
+	uint64_t requests;
+};
+
+
+struct conn {
+	bool open;
+	size_t m;
+	uint64_t gen;
+	string in;
+#ifdef USE_SSL
+	SSL *ssl;
+#endif
+};
+
+
+// Responses travel through the "network" in steps: the request reaches
+// the server (stamp), the response reaches the client (send) and, when
+// split, its rest follows (rest).
+enum {
+	J_STAMP = 0,
+	J_SEND,
+	J_REST
+};
+
+struct job {
+	int64_t at;
+	int fd, step;
+	uint64_t gen;
+	bool close;
+	string out;
+
+	bool operator>(const job &o) const
+	{
+		return at > o.at;
+	}
+};
+
+
+class farm {
+
+	poller p;
+	vector<conn> conns;
+	map<int, size_t> listeners;
+	priority_queue<job, vector<job>, greater<job> > jobs;
+	uint64_t gen;
+	uint32_t rnd;
+	volatile bool done;
+	pthread_t tid;
+
+	string e;
+
+	double uniform();
+
+	int64_t exponential(int64_t);
+
+	void drop(int);
+
+	void request(int, bool);
+
+	void receive(int);
+
+	int send(int, const string &);
+
+#ifdef USE_SSL
+	SSL_CTX *sctx;
+
+	int tls_init();
+#endif
+
+	void run_job(job &);
+
+	static void *run(void *);
+
+public:
+
+	vector<mock> mocks;
+
+	// offset of the farm clock against ours, and the spread of
+	// the response delay, usec; loss in percent
+	int64_t truth, jitter;
+	int loss;
+
+	// TLS handshakes served, and how many of them were resumed
+	uint64_t handshakes, resumed;
+
+	farm(uint32_t seed) : gen(0), rnd(seed ? seed : 1), done(0), tid(0), e(""), truth(0), jitter(0), loss(0),
+	                      handshakes(0), resumed(0)
+	{
+#ifdef USE_SSL
+		sctx = NULL;
+#endif
+	}
+
+	~farm();
+
+	uint32_t random();
+
+	int add(mock &);
+
+	int start();
+
+	void stop();
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+// xorshift32
+uint32_t farm::random()
+{
+	rnd ^= rnd<<13;
+	rnd ^= rnd>>17;
+	rnd ^= rnd<<5;
+	return rnd;
+}
+
+
+double farm::uniform()
+{
+	return (double)random()/4294967296.0;
+}
+
+
+int64_t farm::exponential(int64_t mean)
+{
+	if (mean <= 0)
+		return 0;
+	return (int64_t)(-log(1.0 - uniform())*mean);
+}
+
+
+farm::~farm()
+{
+	stop();
+	for (size_t i = 0; i < conns.size(); ++i) {
+		if (conns[i].open)
+			drop(i);
+	}
+	for (size_t i = 0; i < mocks.size(); ++i)
+		close(mocks[i].lfd);
+#ifdef USE_SSL
+	if (sctx)
+		SSL_CTX_free(sctx);
+#endif
+}
+
+
+int farm::add(mock &m)
+{
+	struct sockaddr_in sin;
+	socklen_t sl = sizeof(sin);
+	int one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	if (inet_pton(AF_INET, m.host.c_str(), &sin.sin_addr) != 1) {
+		e = "farm::add::inet_pton: bad address " + m.host;
+		return -1;
+	}
+	if ((m.lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		e = "farm::add::socket:";
+		e += strerror(errno);
+		return -1;
+	}
+	setsockopt(m.lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(m.lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(m.lfd, 128) < 0 ||
+	    getsockname(m.lfd, (struct sockaddr *)&sin, &sl) < 0 || nonblock(m.lfd) < 0) {
+		e = "farm::add::bind(" + m.host + "):";
+		e += strerror(errno);
+		close(m.lfd);
+		return -1;
+	}
+	char port[16];
+	snprintf(port, sizeof(port), "%u", ntohs(sin.sin_port));
+	m.port = port;
+	m.requests = 0;
+	mocks.push_back(m);
+	return 0;
+}
+
+
+void farm::drop(int fd)
+{
+#ifdef USE_SSL
+	if (conns[fd].ssl)
+		SSL_free(conns[fd].ssl);
+	conns[fd].ssl = NULL;
+#endif
+	p.del(fd);
+	close(fd);
+	conns[fd].open = 0;
+	conns[fd].in.clear();
+}
+
+
+int farm::send(int fd, const string &out)
+{
+#ifdef USE_SSL
+	if (conns[fd].ssl)
+		return SSL_write(conns[fd].ssl, out.c_str(), out.size()) == (int)out.size() ? 0 : -1;
+#endif
+	return writen(fd, out.c_str(), out.size()) > 0 ? 0 : -1;
+}
+
+
+// Read what arrived, TLS or not, and queue the requests in it
+void farm::receive(int fd)
+{
+	char buf[4096];
+	ssize_t r = 0;
+
+	for (;;) {
+		conn &c = conns[fd];
+#ifdef USE_SSL
+		if (c.ssl) {
+			if (!SSL_is_init_finished(c.ssl)) {
+				int h = SSL_do_handshake(c.ssl);
+				if (h != 1) {
+					h = SSL_get_error(c.ssl, h);
+					if (h != SSL_ERROR_WANT_READ && h != SSL_ERROR_WANT_WRITE)
+						drop(fd);
+					return;
+				}
+				++handshakes;
+				resumed += SSL_session_reused(c.ssl);
+			}
+			if ((r = SSL_read(c.ssl, buf, sizeof(buf))) <= 0) {
+				int e = SSL_get_error(c.ssl, r);
+				if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE)
+					drop(fd);
+				return;
+			}
+		} else
+#endif
+		if ((r = read(fd, buf, sizeof(buf))) <= 0) {
+			if (r < 0 && (errno == EAGAIN || errno == EINTR))
+				return;
+			drop(fd);
+			return;
+		}
+
+		c.in.append(buf, r);
+		string::size_type end;
+		while ((end = c.in.find("\r\n\r\n")) != string::npos) {
+			bool close = c.in.compare(0, end, "HTTP/1.0") == 0 || c.in.find("HTTP/1.0\r\n") < end;
+			c.in.erase(0, end + 4);
+			request(fd, close);
+		}
+	}
+}
+
+
+#ifdef USE_SSL
+
+// a throw-away self-signed P-256 certificate
+int farm::tls_init()
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *kc = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	X509 *x = NULL;
+	int r = -1;
+
+	if (!kc || EVP_PKEY_keygen_init(kc) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kc, NID_X9_62_prime256v1) <= 0 || EVP_PKEY_keygen(kc, &pkey) <= 0)
+		goto out;
+	if ((x = X509_new()) == NULL)
+		goto out;
+	X509_set_version(x, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), -86400);
+	X509_gmtime_adj(X509_getm_notAfter(x), 86400);
+	X509_set_pubkey(x, pkey);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x), "CN", MBSTRING_ASC, (const unsigned char *)"httpdate-sim",
+	                           -1, -1, 0);
+	X509_set_issuer_name(x, X509_get_subject_name(x));
+	if (X509_sign(x, pkey, EVP_sha256()) <= 0)
+		goto out;
+	if ((sctx = SSL_CTX_new(TLS_server_method())) == NULL)
+		goto out;
+	if (SSL_CTX_use_certificate(sctx, x) != 1 || SSL_CTX_use_PrivateKey(sctx, pkey) != 1)
+		goto out;
+	r = 0;
+out:
+	if (r < 0)
+		e = "farm::tls_init: cannot set up the server certificate";
+	X509_free(x);
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_CTX_free(kc);
+	return r;
+}
+
+#endif
+
+
+// A request is complete. Unless it gets lost, it reaches the server
+// after one latency.
+void farm::request(int fd, bool close)
+{
+	mock &m = mocks[conns[fd].m];
+	++m.requests;
+	if ((int)(random() % 100) < loss)
+		return;
+
+	job j;
+	j.at = mono_usec() + m.latency + exponential(jitter);
+	j.fd = fd;
+	j.step = J_STAMP;
+	j.gen = conns[fd].gen;
+	j.close = close || m.quirk == Q_CLOSE;
+	jobs.push(j);
+}
+
+
+void farm::run_job(job &j)
+{
+	if (!conns[j.fd].open || conns[j.fd].gen != j.gen)
+		return;
+
+	mock &m = mocks[conns[j.fd].m];
+	if (j.step == J_STAMP) {
+		int64_t now = real_usec() + truth + m.skew;
+		time_t t = now/1000000;
+		struct tm tm;
+		char date[64], buf[160];
+
+		gmtime_r(&t, &tm);
+		strftime(date, sizeof(date), date_formats[m.quirk == Q_RFC850 ? 1 : m.quirk == Q_ASCTIME ? 2 : 0], &tm);
+
+		j.out = "HTTP/1.1 200 OK\r\nServer: httpdate-sim\r\n";
+		if (m.quirk != Q_NODATE)
+			j.out += string(m.quirk == Q_LOWER ? "date: " : "Date: ") + date + "\r\n";
+		j.out += "Content-Length: 0\r\n";
+		if (j.close)
+			j.out += "Connection: close\r\n";
+		if (m.hires) {
+			snprintf(buf, sizeof(buf), "X-Httpdate: rx=%lld.%06lld tx=%lld.%06lld stratum=%d error=0.000%03d\r\n",
+			         (long long)(now/1000000), (long long)(now%1000000), (long long)(now/1000000),
+			         (long long)(now%1000000), 1, 100);
+			j.out += buf;
+		}
+		j.out += "\r\n";
+
+		j.step = J_SEND;
+		j.at = mono_usec() + m.latency + exponential(jitter);
+		jobs.push(j);
+		return;
+	}
+
+	// split in the middle of the Date line, the rest 20ms later
+	string out = j.out;
+	if (j.step == J_SEND && m.quirk == Q_SPLIT) {
+		size_t n = out.find("ate: ");
+		if (n == string::npos)
+			n = out.size()/2;
+		out = j.out.substr(0, n + 10);
+		j.out.erase(0, n + 10);
+		j.step = J_REST;
+		j.at = mono_usec() + 20000;
+		jobs.push(j);
+		if (send(j.fd, out) < 0)
+			drop(j.fd);
+		return;
+	}
+
+	if (send(j.fd, out) < 0 || j.close)
+		drop(j.fd);
+}
+
+
+void *farm::run(void *vp)
+{
+	farm *f = (farm *)vp;
+	vector<poller::event> ev;
+
+	while (!f->done) {
+		int64_t now = mono_usec();
+		while (!f->jobs.empty() && f->jobs.top().at <= now) {
+			job j = f->jobs.top();
+			f->jobs.pop();
+			f->run_job(j);
+		}
+
+		int msec = 100;
+		if (!f->jobs.empty())
+			msec = (int)min((int64_t)100, (f->jobs.top().at - now + 999)/1000);
+		if (f->p.wait(ev, msec) < 0)
+			break;
+
+		for (vector<poller::event>::iterator i = ev.begin(); i != ev.end(); ++i) {
+			map<int, size_t>::iterator l = f->listeners.find(i->fd);
+			if (l != f->listeners.end()) {
+				int fd = -1;
+				while ((fd = accept(i->fd, NULL, NULL)) >= 0) {
+					if (nonblock(fd) < 0 || f->p.add(fd, poller::POLL_IN) < 0) {
+						close(fd);
+						continue;
+					}
+					if ((size_t)fd >= f->conns.size())
+						f->conns.resize(fd + 1);
+					conn &c = f->conns[fd];
+					c.open = 1;
+					c.m = l->second;
+					c.gen = ++f->gen;
+					c.in.clear();
+#ifdef USE_SSL
+					c.ssl = NULL;
+					if (f->mocks[c.m].tls && (c.ssl = SSL_new(f->sctx)) != NULL) {
+						SSL_set_fd(c.ssl, fd);
+						SSL_set_accept_state(c.ssl);
+					}
+#endif
+				}
+				continue;
+			}
+
+			int fd = i->fd;
+			if ((size_t)fd >= f->conns.size() || !f->conns[fd].open)
+				continue;
+			f->receive(fd);
+		}
+	}
+	return NULL;
+}
+
+
+int farm::start()
+{
+#ifdef USE_SSL
+	for (size_t i = 0; i < mocks.size(); ++i) {
+		if (mocks[i].tls && !sctx && tls_init() < 0)
+			return -1;
+	}
+#endif
+	if (p.init() < 0) {
+		e = "farm::start::";
+		e += p.why();
+		return -1;
+	}
+	for (size_t i = 0; i < mocks.size(); ++i) {
+		if (p.add(mocks[i].lfd, poller::POLL_IN) < 0) {
+			e = "farm::start::";
+			e += p.why();
+			return -1;
+		}
+		listeners[mocks[i].lfd] = i;
+	}
+	if ((errno = pthread_create(&tid, NULL, run, this)) != 0) {
+		e = "farm::start::pthread_create:";
+		e += strerror(errno);
+		tid = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+void farm::stop()
+{
+	if (tid == 0)
+		return;
+	done = 1;
+	pthread_join(tid, NULL);
+	tid = 0;
+}
+
+
+// CPU time of the calling thread, usec
+int64_t cpu_usec()
+{
+	struct rusage ru;
+#ifdef RUSAGE_THREAD
+	getrusage(RUSAGE_THREAD, &ru);
+#else
+	getrusage(RUSAGE_SELF, &ru);
+#endif
+	return (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+
+int64_t percentile(vector<int64_t> v, double q)
+{
+	if (v.empty())
+		return 0;
+	sort(v.begin(), v.end());
+	return v[min(v.size() - 1, (size_t)(q*v.size()))];
+}
+
+
+// Checks parse_http_date() against timegm() on n random times in all
+// three formats, and that it rejects every truncation, wrong day name and
+// out of range field. Single byte mutations it accepts must decode as
+// strptime() does. Returns the number of failures.
+int check_parser(int n)
+{
+	static const char *malformed[] = {
+		"Sun, 06 Foo 1994 08:49:37 GMT", "Sun, 00 Nov 1994 08:49:37 GMT", "Thu, 31 Nov 1994 08:49:37 GMT",
+		"Tue, 30 Feb 2000 08:49:37 GMT", "Sun, 29 Feb 1998 08:49:37 GMT", "Sun, 06 Nov 1994 24:00:00 GMT",
+		"Sun, 06 Nov 1994 08:60:37 GMT", "Sun, 06 Nov 1994 08:49:61 GMT", "Wed, 31 Dec 1969 23:59:59 GMT",
+		"Sun, 06 Nov 1994 08:49:37 UTC", "Sun,06 Nov 1994 08:49:37 GMT ", "Sun, 06 Nov 1994 08.49.37 GMT",
+		"Sun, 0x Nov 1994 08:49:37 GMT", "Sun, 06 Nov 94 08:49:37 GMT", "Sun, 06 Nov 1994 08:49:37",
+		"Thursday, 31-Nov-94 08:49:37 GMT", "Sunsday, 06-Nov-94 08:49:37 GMT", "Sunday, 06 Nov 94 08:49:37 GMT",
+		"Sunday, 06-Nov-1994 08:49:37 GMT", "Sun Nov 31 08:49:37 1994", "Sun Nov  6 08:49:37 94",
+		"Sun Nov 6 08:49:37 1994", "Sun Nov  6 8:49:37 1994", "Sun Xyz  6 08:49:37 1994",
+		"Mon, 06 Nov 1994 08:49:37 GMT", "Monday, 06-Nov-94 08:49:37 GMT", "Mon Nov  6 08:49:37 1994",
+		"", "Sun", "Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+	};
+	const int sample = 10000;
+	int64_t range = sizeof(time_t) > 4 ? 253402300800LL : 2147483648LL;
+	uint64_t x = 88172645463325252ULL;
+	int checked = 0, rejected = 0, fuzzed = 0, failed = 0;
+	char buf[64], mut[64];
+	time_t t = 0, want = 0, r = 0;
+	struct tm tm, ltm;
+
+	for (size_t i = 0; i < sizeof(malformed)/sizeof(malformed[0]); ++i) {
+		++rejected;
+		if (parse_http_date(malformed[i], strlen(malformed[i]), t) == 0 && failed++ < 10)
+			printf("parser accepts       \"%s\"\n", malformed[i]);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		// xorshift64, up to the end of year 9999
+		x ^= x<<13;
+		x ^= x>>7;
+		x ^= x<<17;
+		r = (time_t)(x % range);
+		gmtime_r(&r, &tm);
+		want = timegm(&tm);
+
+		for (int f = 0; f < 3; ++f) {
+			// two digit years only reach 1970 to 2069
+			if (f == 1 && (tm.tm_year < 70 || tm.tm_year >= 170))
+				continue;
+			size_t len = strftime(buf, sizeof(buf), date_formats[f], &tm);
+			++checked;
+			if ((parse_http_date(buf, len, t) < 0 || t != want) && failed++ < 10)
+				printf("parser misreads      \"%s\"\n", buf);
+			if (i >= sample)
+				continue;
+
+			for (size_t l = 0; l < len; ++l) {
+				++rejected;
+				if (parse_http_date(buf, l, t) == 0 && failed++ < 10)
+					printf("parser accepts       \"%.*s\"\n", (int)l, buf);
+			}
+
+			struct tm wrong = tm;
+			for (int d = 1; d < 7; ++d) {
+				wrong.tm_wday = (tm.tm_wday + d) % 7;
+				size_t wl = strftime(mut, sizeof(mut), date_formats[f], &wrong);
+				++rejected;
+				if (parse_http_date(mut, wl, t) == 0 && failed++ < 10)
+					printf("parser accepts       \"%s\"\n", mut);
+			}
+
+			// strptime() reads two digit years from 69 on as 19xx
+			if (f == 1 && tm.tm_year >= 169)
+				continue;
+			memcpy(mut, buf, len);
+			mut[x % len] = (char)(32 + (x>>32) % 95);
+			if (parse_http_date(mut, len, t) < 0)
+				continue;
+			++fuzzed;
+			memset(&ltm, 0, sizeof(ltm));
+			mut[len] = 0;
+			const char *end = strptime(mut, date_formats[f], &ltm);
+			if ((end == NULL || *end != 0 || timegm(&ltm) != t) && failed++ < 10)
+				printf("parser differs from strptime() on \"%s\"\n", mut);
+		}
+	}
+
+	printf("parse_http_date      %d dates agree with timegm(), %d malformed rejected, "
+	       "%d mutations agree with strptime()\n", checked, rejected, fuzzed);
+	if (failed > 0)
+		printf("parse_http_date      %d checks FAILED\n", failed);
+	return failed;
+}
+
+
+// parse_http_date() against the libc path it replaced
+void bench_parser(int n)
+{
+	vector<string> dates;
+	char buf[64];
+	srand(1);
+	for (int i = 0; i < 4096; ++i) {
+		time_t t = (time_t)(rand() % 2000000000);
+		strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+		dates.push_back(buf);
+	}
+
+	time_t sum = 0, t = 0;
+	int64_t start = mono_usec();
+	for (int i = 0; i < n; ++i) {
+		const string &s = dates[i & 4095];
+		if (parse_http_date(s.c_str(), s.size(), t) == 0)
+			sum += t;
+	}
+	int64_t ours = mono_usec() - start;
+
+	struct tm tm;
+	start = mono_usec();
+	for (int i = 0; i < n; ++i) {
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(dates[i & 4095].c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL)
+			sum -= timegm(&tm);
+	}
+	int64_t libc = mono_usec() - start;
+
+	printf("parse_http_date      %8.1fns/date\n", (double)ours*1000/n);
+	printf("strptime()+timegm()  %8.1fns/date\n", (double)libc*1000/n);
+	if (sum != 0)
+		printf("MISMATCH between both parsers\n");
+}
+
+
+// Requests per second a synced date_server answers on loopback, each of
+// conns keep-alive connections with one HEAD outstanding at a time
+void bench_date_server(int n, int conns)
+{
+	// its thread never ends, so neither may the server
+	date_server *ds = new date_server;
+	string port = "";
+	char buf[4096];
+
+	for (int i = 18123; i < 18223 && port.empty(); ++i) {
+		snprintf(buf, sizeof(buf), "%d", i);
+		if (ds->listen(buf) == 0)
+			port = buf;
+	}
+	if (port.empty() || ds->start() < 0) {
+		printf("date_server          %s\n", ds->why());
+		return;
+	}
+	ds->sync(1, 1000, mono_usec());
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(port.c_str()));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	const string req = "HEAD / HTTP/1.1\r\nHost: bench\r\n\r\n";
+	map<int, string> in;
+	vector<poller::event> ev;
+	poller p;
+	int sent = 0, answered = 0, failed = 0;
+
+	if (p.init() < 0) {
+		printf("date_server          %s\n", p.why());
+		return;
+	}
+
+	int64_t start = mono_usec();
+	for (int i = 0; i < conns; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || nonblock(fd) < 0 ||
+		    p.add(fd, poller::POLL_IN) < 0 || writen(fd, req.c_str(), req.size()) < 0) {
+			printf("date_server          connect:%s\n", strerror(errno));
+			return;
+		}
+		in[fd] = "";
+		++sent;
+	}
+
+	while (answered < sent) {
+		if (p.wait(ev, 1000) < 0 || ev.empty())
+			break;
+		for (vector<poller::event>::iterator i = ev.begin(); i != ev.end(); ++i) {
+			ssize_t r = read(i->fd, buf, sizeof(buf));
+			if (r <= 0)
+				continue;
+			string &s = in[i->fd];
+			string::size_type end = 0;
+			s.append(buf, r);
+			while ((end = s.find("\r\n\r\n")) != string::npos) {
+				failed += s.compare(0, 12, "HTTP/1.1 200") != 0;
+				++answered;
+				s.erase(0, end + 4);
+				if (sent < n && writen(i->fd, req.c_str(), req.size()) > 0)
+					++sent;
+			}
+		}
+	}
+	int64_t t = mono_usec() - start;
+
+	for (map<int, string>::iterator i = in.begin(); i != in.end(); ++i)
+		close(i->first);
+
+	printf("date_server          %8.0freq/s over %d connections\n", t > 0 ? (double)answered*1000000/t : 0.0, conns);
+	if (answered < n || failed > 0)
+		printf("date_server          %d of %d requests answered, %d not with 200\n", answered, n, failed);
+}
+
+
+void usage(const char *p)
+{
+	printf("\n%s\t[-n servers (16)] [-l liars (3)] [-r rounds (10)] [-i pause between rounds (0s)]\n"
+	       "\t\t[-o farm offset (1234ms)] [-k honest skew spread (10ms)] [-d max latency (20ms)]\n"
+	       "\t\t[-j latency jitter (2ms)] [-L loss (0%%)] [-q quirky servers (25%%)]\n"
+	       "\t\t[-x X-Httpdate servers (0%%)] [-T HTTPS servers (0%%)] [-s timeout (1s)]\n"
+	       "\t\t[-w timeout (ms)] [-B boundary probes (0)] [-p burst samples (1)] [-K keep-alive idle limit (0s)]\n"
+	       "\t\t[-E intersect|median|trimmed (intersect)]"
+	       " [-c convergence target (50ms)]\n\t\t[-S seed] [-v] [-b parser and date server benchmark]\n\n", p);
+	exit(0);
+}
+
+}
+
+
+int main(int argc, char **argv)
+{
+	int n = 16, liars = 3, rounds = 10, pause = 0, spread = 10, latency = 20, jitter = 2, loss = 0,
+	    quirky = 25, hires = 0, https = 0, msec = 1000, boundary = 0, burst = 1, keep_alive = 0, target = 50,
+	    c = 0;
+	int64_t offset = 1234;
+	uint32_t seed = (uint32_t)mono_usec();
+	bool verbose = 0;
+	Estimator::estimator_t est = Estimator::EST_INTERSECT;
+
+	while ((c = getopt(argc, argv, "n:l:r:i:o:k:d:j:L:q:x:T:s:w:B:p:K:E:c:S:vb")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'l':
+			liars = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'i':
+			pause = atoi(optarg);
+			break;
+		case 'o':
+			offset = atoll(optarg);
+			break;
+		case 'k':
+			spread = atoi(optarg);
+			break;
+		case 'd':
+			latency = atoi(optarg);
+			break;
+		case 'j':
+			jitter = atoi(optarg);
+			break;
+		case 'L':
+			loss = atoi(optarg);
+			break;
+		case 'q':
+			quirky = atoi(optarg);
+			break;
+		case 'x':
+			hires = atoi(optarg);
+			break;
+		case 'T':
+			https = atoi(optarg);
+			break;
+		case 's':
+			if ((msec = atoi(optarg)) < 1 || msec > 60) {
+				fprintf(stderr, "-s takes seconds, 1 to 60; use -w for milliseconds\n");
+				exit(1);
+			}
+			msec *= 1000;
+			break;
+		case 'w':
+			if ((msec = atoi(optarg)) < 1) {
+				fprintf(stderr, "-w takes milliseconds, at least 1\n");
+				exit(1);
+			}
+			break;
+		case 'B':
+			boundary = atoi(optarg);
+			break;
+		case 'p':
+			burst = atoi(optarg);
+			break;
+		case 'K':
+			keep_alive = atoi(optarg);
+			break;
+		case 'E':
+			if (Estimator::parse(optarg, est) < 0)
+				usage(argv[0]);
+			break;
+		case 'c':
+			target = atoi(optarg);
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'b':
+			if (check_parser(1000000) > 0)
+				return 1;
+			bench_parser(10000000);
+			bench_date_server(500000, 64);
+			return 0;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (n < 1 || n > 60000 || liars < 0 || liars > n || rounds < 1)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	Log::init(verbose ? Log::HTTPDATE_STDOUT : Log::HTTPDATE_NOLOG);
+	Log::level(Log::HTTPDATE_DEBUG);
+
+	// The farm runs in a thread of its own. Each mock listens on its own
+	// loopback address, 127.0.0.1 and up, as a host may only be
+	// configured once.
+	farm f(seed);
+	f.truth = offset*1000;
+	f.jitter = (int64_t)jitter*1000;
+	f.loss = loss;
+
+	vector<server_config> vc;
+	map<string, size_t> by_port;
+	for (int i = 0; i < n; ++i) {
+		mock m;
+		char host[32];
+		snprintf(host, sizeof(host), "127.0.%d.%d", (i + 1)/256, (i + 1)%256);
+		m.host = host;
+		m.liar = i < liars;
+		m.hires = (int)(f.random() % 100) < hires;
+		m.tls = (int)(f.random() % 100) < https;
+#ifndef USE_SSL
+		if (m.tls) {
+			fprintf(stderr, "HTTPS servers need a build with USE_SSL\n");
+			return 1;
+		}
+#endif
+		m.latency = latency > 0 ? (int64_t)(f.random() % (latency*1000)) : 0;
+		m.quirk = Q_NONE;
+		if (!m.liar && (int)(f.random() % 100) < quirky)
+			m.quirk = 1 + f.random() % (Q_MAX - 1);
+
+		// liars are off by 10s to an hour either way
+		if (m.liar)
+			m.skew = ((int64_t)(f.random() % 3590) + 10)*1000000*(f.random() & 1 ? 1 : -1);
+		else
+			m.skew = spread > 0 ? (int64_t)(f.random() % (2*spread*1000)) - spread*1000 : 0;
+		if (f.add(m) < 0) {
+			fprintf(stderr, "%s\n", f.why());
+			return 1;
+		}
+		server_config c;
+		c.name = m.host;
+		c.port = f.mocks.back().port;
+		c.https = m.tls;
+		vc.push_back(c);
+		by_port[f.mocks.back().port] = i;
+	}
+	if (f.start() < 0) {
+		fprintf(stderr, "%s\n", f.why());
+		return 1;
+	}
+
+	int q[Q_MAX];
+	memset(q, 0, sizeof(q));
+	for (size_t i = 0; i < f.mocks.size(); ++i)
+		++q[f.mocks[i].quirk];
+	printf("farm: %d servers, %d liars, offset %lldms +/- %dms, latency <= %dms + %dms, loss %d%%, seed %u\n",
+	       n, liars, (long long)offset, spread, latency, jitter, loss, seed);
+	printf("quirks:");
+	for (int i = 0; i < Q_MAX; ++i)
+		printf(" %s=%d", quirk_names[i], q[i]);
+	printf(", X-Httpdate=%d, HTTPS=%d\n\n",
+	       (int)count_if(f.mocks.begin(), f.mocks.end(), [](const mock &m) { return m.hires; }),
+	       (int)count_if(f.mocks.begin(), f.mocks.end(), [](const mock &m) { return m.tls; }));
+
+	http_date hd;
+	hd.no_set(1);
+	hd.boundary(boundary);
+	hd.burst(burst);
+	hd.keep_alive(keep_alive);
+	hd.estimator(est);
+	if (hd.time_servers(vc) < 0) {
+		fprintf(stderr, "%s\n", hd.why().c_str());
+		return 1;
+	}
+
+	const server_table &st = hd.table();
+	vector<size_t> mock_of(st.size(), 0);
+	for (size_t row = 0; row < st.size(); ++row) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)&st.addr[row];
+		char port[16];
+		snprintf(port, sizeof(port), "%u", ntohs(sin->sin_port));
+		mock_of[row] = by_port[port];
+	}
+
+	vector<int64_t> errors, bounds, cpu, wall;
+	uint64_t liar_samples = 0, liars_rejected = 0, honest_samples = 0, honest_kept = 0;
+	int estimates = 0, inside = 0, converged = -1;
+	int64_t start = mono_usec(), converged_at = 0, published = 0;
+
+	printf("round     offset error       bound  samples  used    cpu      wall\n");
+	for (int r = 0; r < rounds; ++r) {
+		if (r > 0 && pause > 0)
+			sleep(pause);
+
+		hd.poll_now();
+		int64_t t0 = mono_usec(), c0 = cpu_usec();
+		if (hd.loop(msec) < 0) {
+			fprintf(stderr, "%s\n", hd.why().c_str());
+			return 1;
+		}
+		int64_t c1 = cpu_usec(), t1 = mono_usec();
+		cpu.push_back(c1 - c0);
+		wall.push_back(t1 - t0);
+
+		const round_result &res = hd.result();
+		if (res.mono == published) {
+			printf("%5d  %20s  %10s  %7s  %4s %6lldus %7.1fms\n", r + 1, "no estimate", "", "", "",
+			       (long long)(c1 - c0), (double)(t1 - t0)/1000);
+			continue;
+		}
+		published = res.mono;
+		++estimates;
+
+		int64_t err = res.offset - f.truth;
+		errors.push_back(llabs(err));
+		bounds.push_back(res.error);
+		if (llabs(err) <= res.error + spread*1000)
+			++inside;
+		if (llabs(err) <= (int64_t)target*1000) {
+			if (converged < 0) {
+				converged = r + 1;
+				converged_at = t1 - start;
+			}
+		} else
+			converged = -1;
+
+		// A sample made it into the estimate if its interval holds it
+		for (size_t row = 0; row < st.size(); ++row) {
+			if (st.sampled[row] < t0)
+				continue;
+			bool agrees = llabs(st.offset[row] - res.offset) <= st.error[row];
+			if (f.mocks[mock_of[row]].liar) {
+				++liar_samples;
+				liars_rejected += !agrees;
+			} else {
+				++honest_samples;
+				honest_kept += agrees;
+			}
+		}
+
+		printf("%5d  %+16.6fs %+10.6fs  %7d  %4d %6lldus %7.1fms\n", r + 1, (double)err/1000000,
+		       (double)res.error/1000000, res.samples, res.used, (long long)(c1 - c0), (double)(t1 - t0)/1000);
+	}
+	f.stop();
+
+	printf("\nestimates           %d of %d rounds, truth within bound in %d\n", estimates, rounds, inside);
+	if (!errors.empty()) {
+		printf("offset error        median %.6fs  p95 %.6fs  max %.6fs\n", (double)percentile(errors, 0.5)/1000000,
+		       (double)percentile(errors, 0.95)/1000000, (double)percentile(errors, 1.0)/1000000);
+		printf("error bound         median %.6fs\n", (double)percentile(bounds, 0.5)/1000000);
+	}
+	if (converged > 0)
+		printf("converged           round %d after %.3fs (within %dms)\n", converged,
+		       (double)converged_at/1000000, target);
+	else
+		printf("converged           never (within %dms)\n", target);
+	if (liar_samples > 0)
+		printf("falsetickers        %.1f%% of %llu samples rejected\n", 100.0*liars_rejected/liar_samples,
+		       (unsigned long long)liar_samples);
+	if (honest_samples > 0)
+		printf("truechimers         %.1f%% of %llu samples used\n", 100.0*honest_kept/honest_samples,
+		       (unsigned long long)honest_samples);
+	printf("cpu per round       median %lldus  max %lldus\n", (long long)percentile(cpu, 0.5),
+	       (long long)percentile(cpu, 1.0));
+	printf("wall per round      median %.1fms\n", (double)percentile(wall, 0.5)/1000);
+	uint64_t samples = 0, stamped = 0;
+	for (size_t i = 0; i < st.size(); ++i) {
+		samples += st.stats[i].samples;
+		stamped += st.stats[i].stamped;
+	}
+	if (samples > 0)
+		printf("kernel stamped      %.1f%% of %llu samples\n", 100.0*stamped/samples, (unsigned long long)samples);
+	if (f.handshakes > 0)
+		printf("TLS handshakes      %llu, %llu resumed\n", (unsigned long long)f.handshakes,
+		       (unsigned long long)f.resumed);
+
+	return 0;
+}
+
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef USE_SSL
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/bio.h>
+#include <openssl/err.h>
+
+#include "misc.h"
+#include "tls.h"
+
+
+using namespace std;
+
+
+namespace {
+
+// The read of the stamped socket BIO. Without read-ahead OpenSSL reads a
+// record at a time, so the last recvmsg() before SSL_read() returns data
+// is the one that completed its record. Its stamp goes to the int64_t
+// that tls_client::read() hangs off the BIO.
+int stamped_read(BIO *b, char *buf, int n)
+{
+	int64_t stamp = 0, *out = (int64_t *)BIO_get_app_data(b);
+	int fd = -1;
+
+	if (buf == NULL || n <= 0)
+		return 0;
+	BIO_get_fd(b, &fd);
+	errno = 0;
+	ssize_t r = recv_stamped(fd, buf, n, 0, stamp);
+	BIO_clear_retry_flags(b);
+	if (r > 0 && out)
+		*out = stamp;
+	else if (r < 0 && BIO_sock_should_retry(r))
+		BIO_set_retry_read(b);
+	return (int)r;
+}
+
+}
+
+
+tls_client::tls_client() : ctx(NULL), meth(NULL), e("")
+{
+}
+
+
+tls_client::~tls_client()
+{
+	for (map<int, SSL *>::iterator i = pooled.begin(); i != pooled.end(); ++i)
+		SSL_free(i->second);
+	for (map<string, SSL_SESSION *>::iterator i = sessions.begin(); i != sessions.end(); ++i)
+		SSL_SESSION_free(i->second);
+	if (ctx)
+		SSL_CTX_free(ctx);
+	if (meth)
+		BIO_meth_free(meth);
+}
+
+
+int tls_client::init()
+{
+	if (ctx)
+		return 0;
+	if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+		e = "tls_client::init::SSL_CTX_new:";
+		e += ERR_error_string(ERR_get_error(), NULL);
+		return -1;
+	}
+	// all of BIO_s_socket() but the read
+	const BIO_METHOD *sock = BIO_s_socket();
+	if ((meth = BIO_meth_new(BIO_TYPE_SOCKET, "stamped socket")) == NULL) {
+		e = "tls_client::init::BIO_meth_new:";
+		e += ERR_error_string(ERR_get_error(), NULL);
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+		return -1;
+	}
+	BIO_meth_set_write(meth, BIO_meth_get_write(sock));
+	BIO_meth_set_read(meth, stamped_read);
+	BIO_meth_set_puts(meth, BIO_meth_get_puts(sock));
+	BIO_meth_set_ctrl(meth, BIO_meth_get_ctrl(sock));
+	BIO_meth_set_create(meth, BIO_meth_get_create(sock));
+	BIO_meth_set_destroy(meth, BIO_meth_get_destroy(sock));
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+	// we keep the sessions ourselves, per name
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	return 0;
+}
+
+
+// A new client SSL on the connected fd, resuming the last session of
+// the name if there is one. The name is sent as SNI unless it is an
+// address.
+SSL *tls_client::open(int fd, const string &name)
+{
+	SSL *ssl = NULL;
+	BIO *b = NULL;
+	unsigned char buf[16];
+
+	if (!ctx || (ssl = SSL_new(ctx)) == NULL)
+		return NULL;
+	if ((b = BIO_new(meth)) == NULL) {
+		SSL_free(ssl);
+		return NULL;
+	}
+	BIO_set_fd(b, fd, BIO_NOCLOSE);
+	SSL_set_bio(ssl, b, b);
+	if (inet_pton(AF_INET, name.c_str(), buf) != 1 && inet_pton(AF_INET6, name.c_str(), buf) != 1)
+		SSL_set_tlsext_host_name(ssl, name.c_str());
+	map<string, SSL_SESSION *>::iterator i = sessions.find(name);
+	if (i != sessions.end())
+		SSL_set_session(ssl, i->second);
+	SSL_set_connect_state(ssl);
+	return ssl;
+}
+
+
+// SSL_read(), also setting stamp to the CLOCK_REALTIME usec at which the
+// kernel received the record the data comes from, or 0 if it did not say.
+// stamp is left alone while a record is handed out in pieces, so it has
+// to be kept per connection by the caller.
+int tls_client::read(SSL *ssl, char *buf, int n, int64_t &stamp)
+{
+	BIO *b = SSL_get_rbio(ssl);
+
+	BIO_set_app_data(b, &stamp);
+	int r = SSL_read(ssl, buf, n);
+	BIO_set_app_data(b, NULL);
+	return r;
+}
+
+
+// Remember the session for resumption. With TLS 1.3 the tickets come
+// after the handshake, so this is called once a response was read.
+// A copy is kept, since OpenSSL marks the session of an SSL that is
+// freed without a shutdown as not resumable.
+void tls_client::save(const string &name, SSL *ssl)
+{
+	SSL_SESSION *s = SSL_get0_session(ssl);
+	if (!s || !SSL_SESSION_is_resumable(s) || (s = SSL_SESSION_dup(s)) == NULL)
+		return;
+	SSL_SESSION *&slot = sessions[name];
+	if (slot)
+		SSL_SESSION_free(slot);
+	slot = s;
+}
+
+
+void tls_client::pool(int fd, SSL *ssl)
+{
+	drop(fd);
+	pooled[fd] = ssl;
+}
+
+
+// The SSL of a pooled fd, or NULL
+SSL *tls_client::take(int fd)
+{
+	map<int, SSL *>::iterator i = pooled.find(fd);
+	if (i == pooled.end())
+		return NULL;
+	SSL *ssl = i->second;
+	pooled.erase(i);
+	return ssl;
+}
+
+
+// The fd was or will be closed
+void tls_client::drop(int fd)
+{
+	map<int, SSL *>::iterator i = pooled.find(fd);
+	if (i == pooled.end())
+		return;
+	SSL_free(i->second);
+	pooled.erase(i);
+}
+
+
+#endif
+
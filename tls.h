@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2011 Sebastian Krahmer.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Sebastian Krahmer.
+ * 4. The name Sebastian Krahmer may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __tls_h__
+#define __tls_h__
+
+#ifdef USE_SSL
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+
+// TLS for probing HTTPS servers. Certificates are not verified: a clock
+// that is off would fail their validity checks, and the CA store is gone
+// after chroot. A server lying about the time is the estimators business,
+// just as with plain HTTP.
+//
+// Session tickets are kept per name, so that later handshakes are
+// resumed, and idle connections are pooled together with their SSL.
+class tls_client {
+
+	SSL_CTX *ctx;
+
+	// BIO_s_socket() with receive stamps, see read()
+	BIO_METHOD *meth;
+
+	// by name, so they survive reordering of server_table::names
+	std::map<std::string, SSL_SESSION *> sessions;
+
+	// SSL of kept-alive connections, by fd
+	std::map<int, SSL *> pooled;
+
+	std::string e;
+
+public:
+
+	tls_client();
+
+	virtual ~tls_client();
+
+	int init();
+
+	bool enabled() const
+	{
+		return ctx != NULL;
+	}
+
+	SSL *open(int, const std::string &);
+
+	int read(SSL *, char *, int, int64_t &);
+
+	void save(const std::string &, SSL *);
+
+	void pool(int, SSL *);
+
+	SSL *take(int);
+
+	void drop(int);
+
+	const char *why()
+	{
+		return e.c_str();
+	}
+};
+
+
+#endif
+
+#endif
+